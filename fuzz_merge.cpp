@@ -0,0 +1,565 @@
+// fuzz_merge.cpp
+// In-process fuzz target for the merge engine in main.cpp (writeMerged,
+// escapeForPython, the fences and sealGuest) and for splitMerged, its
+// inverse. Nothing is spawned per input.
+//
+// With libFuzzer:
+//   clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address fuzz_merge.cpp -o fuzz-merge
+//   ./fuzz-merge -dict=fuzz_merge.dict -max_total_time=600
+//
+// Without it, the standalone driver generates structured random inputs:
+//   g++ -std=c++17 -O2 -DPOLYGLOT_FUZZ_STANDALONE fuzz_merge.cpp -o fuzz-merge
+//   ./fuzz-merge -runs=1000000 -seed=1
+//   ./fuzz-merge crash-1234...          (replays saved inputs)
+//
+// POLYGLOT_FUZZ_DIFF=1 also compares every merge with main.py, which runs
+// in one long-lived python3 process fed over a pipe.
+//
+// Input layout: byte 0 picks the pair (bits 0-1 guest language, bit 2 .c
+// instead of .cpp, bit 3 guest first, bit 4 fast layout, bit 5 #line
+// directives); the rest is host text, a NUL, then guest text.
+#define POLYGLOT_NO_MAIN
+#include "main.cpp"
+
+#include <cstdint>
+#include <random>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#endif
+
+namespace {
+
+const char* const guestExts[] = {".py", ".rb", ".sh", ".pl"};
+
+// The standalone driver saves the input being checked here on failure;
+// libFuzzer does that itself.
+const std::string* currentInput = nullptr;
+
+[[noreturn]] void fail(const std::string& what, const std::string& merged) {
+    std::cerr << "fuzz_merge invariant violated: " << what << "\n--- merged ---\n" << merged << "--- end ---\n";
+    if (currentInput) {
+        std::ofstream("fuzz-merge-crash", std::ios::binary) << *currentInput;
+        std::cerr << "input saved to fuzz-merge-crash\n";
+    }
+    std::abort();
+}
+
+// Skips one token that is not a comment or line break: a literal (which
+// stops at the end of its line), a raw string, a pp-number or a single
+// character. Returns npos for a raw string that never closes.
+std::size_t skipToken(const std::string& src, std::size_t i, bool cplusplus) {
+    const std::size_t n = src.size();
+    char c = src[i];
+    auto ident = [](char ch) { return isIdentChar(ch); };
+    if (c == '"' || c == '\'') {
+        std::size_t j = i + 1;
+        while (j < n && src[j] != '\n' && src[j] != c) j += src[j] == '\\' && j + 1 < n && src[j + 1] != '\n' ? 2 : 1;
+        return j < n && src[j] == c ? j + 1 : std::min(j, n);
+    }
+    if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < n && src[i + 1] >= '0' && src[i + 1] <= '9')) {
+        std::size_t j = i + 1;
+        while (j < n) {
+            if (ident(src[j]) || src[j] == '.') j++;
+            else if ((src[j] == '+' || src[j] == '-') && std::strchr("eEpP", src[j - 1])) j++;
+            else if (cplusplus && src[j] == '\'' && j + 1 < n && ident(src[j + 1])) j += 2;
+            else break;
+        }
+        return j;
+    }
+    if (!ident(c)) return i + 1;
+    std::size_t j = i;
+    while (j < n && ident(src[j])) j++;
+    std::string id = src.substr(i, j - i);
+    if (j >= n || src[j] != '"' || (id != "R" && id != "u8R" && id != "uR" && id != "UR" && id != "LR")) return j;
+    std::size_t paren = src.find('(', j + 1);
+    if (paren == std::string::npos || paren - j - 1 > 16) return j;
+    std::string delim = src.substr(j + 1, paren - j - 1);
+    if (delim.find_first_of(std::string(" ()\\\t\v\f\n")) != std::string::npos) return j;
+    for (char d : delim) {
+        if (static_cast<unsigned char>(d) >= 0x80) return j;
+    }
+    std::size_t end = src.find(")" + delim + "\"", paren + 1);
+    return end == std::string::npos ? end : end + delim.size() + 2;
+}
+
+// Independent model of the C preprocessor over a whole file: `#if 0` is
+// false and every other condition true. Appends the text of active
+// non-directive lines to `active`. Returns false if the file is ill-formed
+// (stray or unterminated conditional, comment or raw string, or a splice at
+// the very end).
+bool cppActiveText(const std::vector<std::string>& lines, bool cplusplus, std::string& active) {
+    // Phases 1-2, one physical line at a time.
+    std::string src;
+    for (std::size_t p = 0; p < lines.size(); p++) {
+        std::string line = lines[p];
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::size_t start = 0;
+        for (;;) {
+            std::size_t cr = line.find('\r', start);
+            std::string piece = line.substr(start, cr == std::string::npos ? std::string::npos : cr - start);
+            std::size_t k = piece.size();
+            while (k > 0 && isBlank(piece[k - 1])) k--;
+            bool splice = k > 0 && piece[k - 1] == '\\';
+            if (splice && cr == std::string::npos && p + 1 == lines.size()) return false;
+            src += splice ? piece.substr(0, k - 1) : piece + "\n";
+            if (cr == std::string::npos) break;
+            start = cr + 1;
+        }
+    }
+
+    struct Group { bool parentActive, taken, on; };
+    std::vector<Group> groups;
+    auto isActive = [&] { return groups.empty() || (groups.back().parentActive && groups.back().on); };
+    const std::size_t n = src.size();
+    bool bol = true;
+    for (std::size_t i = 0; i < n;) {
+        char c = src[i];
+        if (src.compare(i, 2, "/*") == 0) {
+            std::size_t end = src.find("*/", i + 2);
+            if (end == std::string::npos) return false;
+            if (isActive()) active.append(src, i, end + 2 - i);
+            i = end + 2;
+            continue;
+        }
+        if (src.compare(i, 2, "//") == 0) {
+            std::size_t end = src.find('\n', i);
+            if (isActive()) active.append(src, i, end - i);
+            i = end;
+            continue;
+        }
+        if (c == '\n' || isBlank(c)) {
+            if (isActive()) active += c;
+            if (c == '\n') bol = true;
+            i++;
+            continue;
+        }
+        if (bol && (c == '#' || src.compare(i, 2, "%:") == 0)) {
+            // The directive runs to the first line break outside a comment;
+            // comments read as a single space.
+            std::string body;
+            std::size_t j = i + (c == '#' ? 1 : 2);
+            while (j < n && src[j] != '\n') {
+                if (src.compare(j, 2, "/*") == 0) {
+                    std::size_t end = src.find("*/", j + 2);
+                    if (end == std::string::npos) return false;
+                    body += ' ';
+                    j = end + 2;
+                } else if (src.compare(j, 2, "//") == 0) {
+                    j = src.find('\n', j);
+                } else {
+                    std::size_t end = skipToken(src, j, cplusplus);
+                    if (end == std::string::npos) return false;
+                    body.append(src, j, end - j);
+                    j = end;
+                }
+            }
+            i = j + 1;
+            bol = true;
+
+            std::size_t k = 0;
+            while (k < body.size() && isBlank(body[k])) k++;
+            std::size_t nameEnd = k;
+            while (nameEnd < body.size() && isIdentChar(body[nameEnd])) nameEnd++;
+            std::string name = body.substr(k, nameEnd - k);
+            std::string rest = body.substr(nameEnd);
+            rest.erase(0, rest.find_first_not_of(" \t\f\v"));
+            rest.erase(rest.find_last_not_of(" \t\f\v") + 1);
+            bool cond = rest != "0";
+            if (name == "if" || name == "ifdef" || name == "ifndef") {
+                bool on = name != "if" || cond;
+                groups.push_back({isActive(), on, on});
+            } else if (name == "elif" || name == "elifdef" || name == "elifndef" || name == "else") {
+                if (groups.empty()) return false;
+                Group& g = groups.back();
+                g.on = !g.taken && (name != "elif" || cond);
+                g.taken = g.taken || g.on;
+            } else if (name == "endif") {
+                if (groups.empty()) return false;
+                groups.pop_back();
+            }
+            continue;
+        }
+        bol = false;
+        std::size_t end = skipToken(src, i, cplusplus);
+        if (end == std::string::npos) return false;
+        if (isActive()) active.append(src, i, end - i);
+        i = end;
+    }
+    return groups.empty();
+}
+
+// What active text means to the compiler, as far as escapeForPython can
+// change it: \' reads as ' inside literals, and comments as a space.
+std::string literalMeaning(const std::string& active, bool cplusplus) {
+    std::string meaning;
+    const std::size_t n = active.size();
+    for (std::size_t i = 0; i < n;) {
+        char c = active[i];
+        if (active.compare(i, 2, "/*") == 0 || active.compare(i, 2, "//") == 0) {
+            std::size_t end = active[i + 1] == '*' ? active.find("*/", i + 2) + 2 : active.find('\n', i);
+            meaning += ' ';
+            i = std::min(end, n);
+            continue;
+        }
+        std::size_t end = std::min(skipToken(active, i, cplusplus), n);
+        if (c != '"' && c != '\'') {
+            meaning.append(active, i, end - i);
+        } else {
+            for (std::size_t j = i; j < end; j++) {
+                if (active[j] == '\\' && j + 1 < end) {
+                    if (active[j + 1] != '\'') meaning += '\\';
+                    meaning += active[++j];
+                } else {
+                    meaning += active[j];
+                }
+            }
+        }
+        i = std::max(end, i + 1);
+    }
+    return meaning;
+}
+
+// Index of the line at which the guest interpreter leaves the fence opened
+// on line `openLine`, following each language's own rules, or npos.
+std::size_t fenceEnd(const std::string& guestExt, const std::vector<std::string>& lines, std::size_t openLine) {
+    if (guestExt == ".py") {
+        // Inside r'''...''' a backslash keeps the next character, newline
+        // included, from ending the literal.
+        for (std::size_t l = openLine, col = 4; l < lines.size(); l++, col = 0) {
+            const std::string& s = lines[l];
+            for (std::size_t i = col; i < s.size(); i++) {
+                if (s[i] == '\\') {
+                    if (++i == s.size()) break;
+                } else if (s.compare(i, 3, "'''") == 0) {
+                    return i == 0 ? l : std::string::npos;
+                }
+            }
+        }
+        return std::string::npos;
+    }
+    for (std::size_t l = openLine + 1; l < lines.size(); l++) {
+        const std::string& s = lines[l];
+        if (guestExt == ".sh" && s == "POLYGLOT_EOF") return l;
+        if (guestExt == ".rb" && s.rfind("=end", 0) == 0 && (s.size() == 4 || std::strchr(" \t\r\f\v", s[4]))) return l;
+        if (guestExt == ".pl" && s.rfind("=cut", 0) == 0
+            && (s.size() == 4 || !std::isalpha(static_cast<unsigned char>(s[4])))) return l;
+    }
+    return std::string::npos;
+}
+
+// Index of the line at which the guest interpreter stops reading the
+// script, scanning from line `from` onwards, or npos. `inPod` is Perl's
+// state on entry: a guest may leave a POD block open. Outside POD, any line
+// starting with =<letter> opens one, =cut included; inside, only =cut
+// closes it, and __END__ does not count.
+std::size_t scriptStop(const std::string& guestExt, const std::vector<std::string>& lines, std::size_t from, bool inPod) {
+    for (std::size_t l = from; l < lines.size(); l++) {
+        const std::string& s = lines[l];
+        if (guestExt == ".sh" && s == "exit") return l;
+        if (guestExt == ".rb" && s == "__END__") return l;
+        if (guestExt != ".pl") continue;
+        if (inPod) {
+            inPod = !(s.rfind("=cut", 0) == 0 && (s.size() == 4 || !std::isalpha(static_cast<unsigned char>(s[4]))));
+        } else if (s.size() > 1 && s[0] == '=' && std::isalpha(static_cast<unsigned char>(s[1]))) {
+            inPod = true;
+        } else if (s == "__END__") {
+            return l;
+        }
+    }
+    return std::string::npos;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// main.py's merge_lines behind a pipe, started once and reused.
+class PythonMerger {
+public:
+    PythonMerger() {
+        std::string dir = fs::path(__FILE__).parent_path().string();
+        const std::string driver =
+            "import sys\n"
+            "sys.path.insert(0, sys.argv[1])\n"
+            "import main\n"
+            "inp, out = sys.stdin.buffer, sys.stdout.buffer\n"
+            "def text(n):\n"
+            "    return inp.read(n).decode('utf-8', 'surrogateescape')\n"
+            "for header in iter(inp.readline, b''):\n"
+            "    ext1, ext2, layout, name, n1, n2 = header.decode().split()\n"
+            "    a, b = text(int(n1)), text(int(n2))\n"
+            "    try:\n"
+            "        lines = main.merge_lines(ext1, main.split_lines(a), ext2, main.split_lines(b), layout,\n"
+            "                                 None if name == '-' else name)\n"
+            "        status, body = 'ok', ''.join(l + '\\n' for l in lines).encode('utf-8', 'surrogateescape')\n"
+            "    except main.MergeError as e:\n"
+            "        status, body = 'err', str(e).encode()\n"
+            "    out.write(b'%s %d\\n' % (status.encode(), len(body)) + body)\n"
+            "    out.flush()\n";
+        int toChild[2], fromChild[2];
+        if (pipe(toChild) != 0 || pipe(fromChild) != 0) throw std::runtime_error("pipe() failed");
+        pid = fork();
+        if (pid == 0) {
+            dup2(toChild[0], STDIN_FILENO);
+            dup2(fromChild[1], STDOUT_FILENO);
+            close(toChild[1]);
+            close(fromChild[0]);
+            execlp("python3", "python3", "-c", driver.c_str(), dir.empty() ? "." : dir.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        close(toChild[0]);
+        close(fromChild[1]);
+        to = fdopen(toChild[1], "wb");
+        from = fdopen(fromChild[0], "rb");
+    }
+
+    ~PythonMerger() {
+        fclose(to);
+        fclose(from);
+        waitpid(pid, nullptr, 0);
+    }
+
+    // Returns false if main.py rejected the pair.
+    bool merge(const std::string& ext1, const std::string& text1,
+               const std::string& ext2, const std::string& text2, Layout layout, const std::string& hostName,
+               std::string& merged) {
+        std::fprintf(to, "%s %s %s %s %zu %zu\n", ext1.c_str(), ext2.c_str(), layout == Layout::Fast ? "fast" : "compat",
+                     hostName.empty() ? "-" : hostName.c_str(), text1.size(), text2.size());
+        std::fwrite(text1.data(), 1, text1.size(), to);
+        std::fwrite(text2.data(), 1, text2.size(), to);
+        std::fflush(to);
+        char status[8] = {};
+        std::size_t len = 0;
+        if (std::fscanf(from, "%7s %zu", status, &len) != 2 || std::fgetc(from) != '\n') {
+            std::cerr << "fuzz_merge: lost the main.py process\n";
+            std::abort();
+        }
+        std::string body(len, '\0');
+        if (std::fread(&body[0], 1, len, from) != len) std::abort();
+        merged = body;
+        return std::strcmp(status, "ok") == 0;
+    }
+
+private:
+    pid_t pid = -1;
+    FILE* to = nullptr;
+    FILE* from = nullptr;
+};
+#endif
+
+// Strips the seal sealGuest may have appended to region.
+void stripSeal(std::vector<std::string>& region, const std::string& merged) {
+    auto seal = std::find(region.rbegin(), region.rend(), sealMarker);
+    if (seal == region.rend()) return;
+    for (auto it = seal.base(); it != region.end(); ++it) {
+        if (*it != "#*/" && *it != "#endif") fail("unexpected seal line: " + *it, merged);
+    }
+    region.erase(seal.base() - 1, region.end());
+}
+
+// --extract recovers both halves, up to what the merge loses: a missing
+// final newline, and Python's escape of a host that already held \'.
+void checkSplit(const std::string& guestExt, const std::string& hostExt, Layout layout,
+                const std::vector<std::string>& host, const std::vector<std::string>& guest, const std::string& merged) {
+    std::optional<SplitMerge> split;
+    try {
+        split = splitMerged(merged, hostExt != ".c", guestExt);
+    } catch (const std::runtime_error& x) {
+        fail(std::string("extract failed: ") + x.what(), merged);
+    }
+    if (!split) fail("extract does not recognize the merge", merged);
+    if (split->guestExt != guestExt) fail("extract took the guest for " + split->guestExt, merged);
+    if (split->layout != (scriptEnd(guestExt).empty() ? Layout::Compat : layout)) fail("extract got the layout wrong", merged);
+
+    auto joined = [](const std::vector<std::string>& lines) {
+        std::string text;
+        for (const std::string& l : lines) text += l + "\n";
+        return text;
+    };
+    std::ostringstream hostOut;
+    writeHost(hostOut, split->host, guestExt);
+    bool lossy = guestExt == ".py" && std::any_of(host.begin(), host.end(), [](const std::string& l) {
+        return l.find("\\'") != std::string::npos;
+    });
+    if (!lossy && hostOut.str() != joined(host)) fail("extracted host differs:\n" + hostOut.str(), merged);
+    if (split->guest != joined(guest)) fail("extracted guest differs:\n" + std::string(split->guest), merged);
+}
+
+// The fast layout: the guest, its seal and the script end in one skipped
+// group, then the host untouched.
+void checkFast(const std::string& guestExt, const std::string& hostExt, const std::vector<std::string>& host,
+               const std::vector<std::string>& guest, const std::vector<std::string>& lines, const std::string& merged) {
+    std::string hostActive, mergedActive;
+    if (cppActiveText(host, hostExt != ".c", hostActive)) {
+        if (!cppActiveText(lines, hostExt != ".c", mergedActive)) fail("merged file is ill-formed for the preprocessor", merged);
+        if (mergedActive != hostActive) fail("preprocessed C/C++ differs from the host", merged);
+    }
+
+    const std::vector<std::string> end = scriptEnd(guestExt);
+    const std::size_t guestEnd = lines.size() - host.size() - 1 - end.size();
+    if (lines.size() < host.size() + end.size() + 2 || lines[0] != "#if 0" || lines[lines.size() - host.size() - 1] != "#endif"
+        || !std::equal(end.begin(), end.end(), lines.begin() + guestEnd)) {
+        fail("unexpected fast layout", merged);
+    }
+    if (!std::equal(host.begin(), host.end(), lines.end() - host.size())) fail("host region altered", merged);
+    // Whatever state the guest leaves the interpreter in, it stops at the
+    // last line of the script end, before the host.
+    for (bool inPod : {false, true}) {
+        if (inPod && guestExt != ".pl") continue;
+        if (scriptStop(guestExt, lines, 1 + guest.size(), inPod) != guestEnd + end.size() - 1) {
+            fail(std::string("the script end does not stop the interpreter") + (inPod ? " inside POD" : ""), merged);
+        }
+    }
+    std::vector<std::string> region(lines.begin() + 1, lines.begin() + guestEnd);
+    stripSeal(region, merged);
+    if (region != guest) fail("guest region differs from the guest source", merged);
+}
+
+void checkOne(const uint8_t* data, std::size_t size) {
+    if (size == 0) return;
+    const std::string guestExt = guestExts[data[0] & 3];
+    const std::string hostExt = data[0] & 4 ? ".c" : ".cpp";
+    const bool guestFirst = data[0] & 8;
+    const Layout layout = data[0] & 16 ? Layout::Fast : Layout::Compat;
+    // Needs escaping both as a C string and for Python's fence; no spaces,
+    // for the main.py protocol.
+    const std::string hostName = data[0] & 32 ? "dir\\h\"'''.cpp" : "";
+    std::string rest(reinterpret_cast<const char*>(data) + 1, size - 1);
+    std::size_t nul = rest.find('\0');
+    std::string hostText = rest.substr(0, nul);
+    std::string guestText = nul == std::string::npos ? "" : rest.substr(nul + 1);
+    std::vector<std::string> host = splitLines(hostText);
+    std::vector<std::string> guest = splitLines(guestText);
+
+    std::ostringstream out;
+    bool rejected = false;
+    try {
+        if (guestFirst) writeMerged(out, guestExt, guest, hostExt, host, layout, hostName);
+        else writeMerged(out, hostExt, host, guestExt, guest, layout, hostName);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    const std::string merged = out.str();
+
+#if defined(__unix__) || defined(__APPLE__)
+    static const bool diff = std::getenv("POLYGLOT_FUZZ_DIFF") != nullptr;
+    if (diff) {
+        static PythonMerger py;
+        std::string pyMerged;
+        bool pyOk = guestFirst ? py.merge(guestExt, guestText, hostExt, hostText, layout, hostName, pyMerged)
+                               : py.merge(hostExt, hostText, guestExt, guestText, layout, hostName, pyMerged);
+        if (pyOk == rejected) fail(std::string("main.py ") + (pyOk ? "accepted" : "rejected") + " the pair", merged);
+        if (pyOk && pyMerged != merged) fail("main.py wrote different output:\n" + pyMerged, merged);
+    }
+#endif
+    if (rejected) {
+        if (!merged.empty()) fail("output written before rejecting", merged);
+        return;
+    }
+
+    checkSplit(guestExt, hostExt, layout, host, guest, merged);
+
+    std::vector<std::string> lines = splitLines(merged);
+    const bool fast = layout == Layout::Fast && !scriptEnd(guestExt).empty();
+
+    // The #line directive sits right before the host; the checks below see
+    // the file without it.
+    if (!hostName.empty()) {
+        std::size_t at = fast ? lines.size() - std::min(lines.size(), host.size() + 1) : 4;
+        std::string directive = lineDirective(1, hostName) + directiveMarker;
+        if (guestExt == ".py") directive = escapeForPython({directive}, hostExt != ".c")[0];
+        if (at >= lines.size() || lines[at] != directive) fail("missing #line directive before the host", merged);
+        lines.erase(lines.begin() + at);
+    }
+    if (fast) {
+        checkFast(guestExt, hostExt, host, guest, lines, merged);
+        return;
+    }
+    std::vector<std::string> written = guestExt == ".py" ? escapeForPython(host, hostExt != ".c") : host;
+
+    // The C/C++ half survives preprocessing intact: the merged file compiles
+    // to the same code as the host, framed by the two blank lines. Python's
+    // escapes may only change how literals and comments are spelled.
+    std::string hostActive, mergedActive;
+    if (cppActiveText(host, hostExt != ".c", hostActive)) {
+        if (!cppActiveText(lines, hostExt != ".c", mergedActive)) fail("merged file is ill-formed for the preprocessor", merged);
+        if (literalMeaning(mergedActive, hostExt != ".c") != literalMeaning("\n" + hostActive + "\n", hostExt != ".c")) {
+            fail("preprocessed C/C++ differs from the host", merged);
+        }
+    }
+
+    // The guest interpreter skips exactly the host region...
+    const std::size_t closeLine = 4 + written.size() + 1;
+    if (lines.size() < closeLine + 5 || lines[1] != openFence(guestExt)) fail("unexpected layout", merged);
+    if (fenceEnd(guestExt, lines, 1) != closeLine) fail("guest fence does not end at the closing fence", merged);
+    if (!std::equal(written.begin(), written.end(), lines.begin() + 4)) fail("host region altered", merged);
+
+    // ...and the guest region is recoverable: everything up to the seal.
+    if (lines[closeLine + 1] != "#endif" || lines[closeLine + 2] != "" || lines[closeLine + 3] != "#if 0"
+        || lines.back() != "#endif") {
+        fail("unexpected layout around the guest region", merged);
+    }
+    std::vector<std::string> region(lines.begin() + closeLine + 4, lines.end() - 1);
+    stripSeal(region, merged);
+    if (region != guest) fail("guest region differs from the guest source", merged);
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size) {
+    checkOne(data, size);
+    return 0;
+}
+
+#ifdef POLYGLOT_FUZZ_STANDALONE
+// Lines built from fragments that matter to one of the four guests or to
+// the C preprocessor, so random inputs hit the interesting cases often.
+static std::string randomText(std::mt19937_64& rng) {
+    static const char* const pieces[] = {
+        "'''", "'", "\"", "\\", "/*", "*/", "//", "#", "# ", "%:", "if", " 0", "else", "elif", "endif",
+        "ifdef X", "#if 0", "#endif", "# else", "=end", "=begin", "=cut", "=pod", "POLYGLOT_EOF",
+        "#polyglot: seal", "#*/", "r'''", "R\"x(", ")x\"", "R\"(", ")\"", "1'2", "0x1p+", "\r", "\t",
+        " ", "x", "#line 1 \"orig.cpp\"", "int main() {}", "print(1)", "__END__", "\xc3\xa9", "\n", "\n", "\n",
+    };
+    std::uniform_int_distribution<std::size_t> pick(0, std::size(pieces) - 1);
+    std::string text;
+    std::size_t count = rng() % 40;
+    for (std::size_t i = 0; i < count; i++) text += pieces[pick(rng)];
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long long runs = 100000;
+    unsigned long long seed = std::random_device{}();
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a.rfind("-runs=", 0) == 0) runs = std::stoull(a.substr(6));
+        else if (a.rfind("-seed=", 0) == 0) seed = std::stoull(a.substr(6));
+        else if (a[0] != '-') files.push_back(a);
+    }
+
+    if (!files.empty()) {
+        for (const std::string& f : files) {
+            std::ifstream in(f, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            checkOne(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+            std::cout << f << ": OK\n";
+        }
+        return 0;
+    }
+
+    std::cout << "fuzz_merge: " << runs << " runs, seed " << seed << "\n";
+    std::mt19937_64 rng(seed);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long r = 0; r < runs; r++) {
+        std::string data(1, static_cast<char>(rng() & 63));
+        data += randomText(rng);
+        data += '\0';
+        data += randomText(rng);
+        currentInput = &data;
+        checkOne(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "done: " << static_cast<unsigned long long>(runs / secs) << " execs/s\n";
+    return 0;
+}
+#endif
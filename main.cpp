@@ -1,4 +1,8 @@
 // main.cpp
+#ifdef POLYGLOT_EMBED_PYTHON
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#endif
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -7,25 +11,591 @@
 #include <memory>
 #include <filesystem>
 #include <stdexcept>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <optional>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <string_view>
+#include <atomic>
+#include <new>
+#include <cstddef>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#define POLYGLOT_POSIX 1
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef POLYGLOT_EMBED_RUBY
+#include <ruby.h>
+#endif
+#ifdef POLYGLOT_EMBED_PERL
+#undef ASSUME  // ruby.h defines it too
+#include <EXTERN.h>
+#include <perl.h>
+EXTERN_C void boot_DynaLoader(pTHX_ CV* cv);
+#endif
+#if defined(POLYGLOT_EMBED_PYTHON) || defined(POLYGLOT_EMBED_RUBY) || defined(POLYGLOT_EMBED_PERL)
+#define POLYGLOT_EMBED 1
+#endif
 
 namespace fs = std::filesystem;
 
 std::string usageStr =
-    "Usage: polyglot <source1> <source2> -o <outputFile>\n"
+    "Usage: polyglot <source1> <source2> -o <outputFile> [-v] [-j <jobs>] [--stats]\n"
+    "       polyglot <host.cpp> <guest>... -o <outputDir>/ [-v] [-j <jobs>] [--stats]\n"
+    "       polyglot --extract <merged.cpp> -o <host.cpp> [<guest>]\n"
+    "       polyglot --extract <mergedDir>/ -o <outputDir>/ [-j <jobs>]\n"
+    "  -j <jobs>  max concurrent checkers when not run under a make jobserver\n"
+    "  --stats    print time, hardware counters and bytes per phase to stderr\n"
+    "  --limit <lang>=<jobs>[:<MB>]  per-language checker cap (0 = none) and memory estimate;\n"
+    "             lang is cpp, py, rb, sh or pl\n"
+    "  --mem-budget <MB>  total estimated checker memory (default: 3/4 of available)\n"
+    "  --layout <compat|fast>  fast puts the guest first and stops its interpreter\n"
+    "             before the C/C++ code (Ruby, Perl, Bash; Python always uses compat)\n"
+    "  --line-directives  emit #line so the compiler sees the C/C++ source's own name\n"
+    "             and line numbers\n"
     "Supported extensions:\n"
     "  C/C++: .cpp, .cc, .cxx, .c\n"
     "  Python: .py\n"
     "  Ruby: .rb\n"
     "  Bash: .sh\n"
     "  Perl: .pl\n";
-    
+
+// Hands out the right to run one child process. Under `make -jN` the slots
+// come from make's jobserver (MAKEFLAGS --jobserver-auth, fifo or pipe style),
+// so polyglot's checkers count against the build's -j. Otherwise the limit is
+// local and set with -j.
+class JobServer {
+public:
+    class Token {
+    public:
+        Token(Token&& other) noexcept
+            : owner(other.owner), byte(other.byte), implicit(other.implicit) {
+            other.owner = nullptr;
+        }
+        Token& operator=(Token&&) = delete;
+        ~Token() { if (owner) owner->release(*this); }
+
+    private:
+        friend class JobServer;
+        explicit Token(JobServer* js) : owner(js) {}
+        JobServer* owner;
+        char byte = '+';
+        bool implicit = false;
+    };
+
+    static JobServer& instance() {
+        static JobServer js;
+        return js;
+    }
+
+    bool fromMake() const { return readFd >= 0; }
+
+    void setLocalLimit(unsigned jobs) {
+        std::lock_guard<std::mutex> lock(mtx);
+        localLimit = std::max(1u, jobs);
+    }
+
+    Token acquire() {
+        Token t(this);
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!fromMake()) {
+            freed.wait(lock, [this] { return running < localLimit; });
+            ++running;
+            return t;
+        }
+        // make already granted this process one implicit token; only jobs
+        // beyond the first take a byte from the jobserver.
+        for (;;) {
+            if (!implicitHeld) {
+                implicitHeld = true;
+                t.implicit = true;
+                return t;
+            }
+            lock.unlock();
+            bool got = readToken(t.byte);
+            lock.lock();
+            if (got) return t;
+        }
+    }
+
+private:
+    JobServer() {
+        localLimit = std::max(1u, std::thread::hardware_concurrency());
+#ifdef POLYGLOT_POSIX
+        const char* makeflags = std::getenv("MAKEFLAGS");
+        if (!makeflags) return;
+        std::string auth;
+        std::istringstream words(makeflags);
+        for (std::string w; words >> w && w != "--";) {
+            for (const char* key : {"--jobserver-auth=", "--jobserver-fds="}) {
+                if (w.rfind(key, 0) == 0) auth = w.substr(std::strlen(key));
+            }
+        }
+        if (auth.empty()) return;
+
+        if (auth.rfind("fifo:", 0) == 0) {
+            int fd = open(auth.substr(5).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) return;
+            readFd = writeFd = fd;
+            ownedFd = fd;
+            return;
+        }
+
+        int r = -1, w = -1;
+        char comma = 0;
+        std::istringstream fds(auth);
+        if (!(fds >> r >> comma >> w) || comma != ',' || r < 0 || w < 0) return;
+        // make only passes the pipe to recipes marked with '+', but leaves
+        // the flag in MAKEFLAGS for the rest. The numbers may then be free,
+        // or already reused for some other file, so both must be pipes.
+        struct stat rs, ws;
+        if (fstat(r, &rs) != 0 || fstat(w, &ws) != 0 || !S_ISFIFO(rs.st_mode) || !S_ISFIFO(ws.st_mode)) return;
+        // Reopen the read end so O_NONBLOCK does not leak into make's own
+        // file description. Without /proc we poll before a blocking read.
+        ownedFd = open(("/proc/self/fd/" + std::to_string(r)).c_str(),
+                       O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        readFd = ownedFd >= 0 ? ownedFd : r;
+        writeFd = w;
+#endif
+    }
+
+    ~JobServer() {
+#ifdef POLYGLOT_POSIX
+        if (ownedFd >= 0) close(ownedFd);
+#endif
+    }
+
+    // Waits briefly for a jobserver byte; returns false on timeout so the
+    // caller can re-check whether the implicit token came back meanwhile.
+    bool readToken(char& byte) {
+#ifdef POLYGLOT_POSIX
+        pollfd p{readFd, POLLIN, 0};
+        if (poll(&p, 1, 50) <= 0) return false;
+        ssize_t n = read(readFd, &byte, 1);
+        return n == 1;
+#else
+        (void)byte;
+        return false;
+#endif
+    }
+
+    void release(Token& t) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!fromMake()) {
+            --running;
+            freed.notify_one();
+        } else if (t.implicit) {
+            implicitHeld = false;
+        } else {
+#ifdef POLYGLOT_POSIX
+            while (write(writeFd, &t.byte, 1) < 0 && errno == EINTR) {}
+#endif
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable freed;
+    unsigned localLimit = 1;
+    unsigned running = 0;
+    bool implicitHeld = false;
+    int readFd = -1;
+    int writeFd = -1;
+    int ownedFd = -1;
+};
+
+#ifdef __linux__
+// Hardware counters for the calling thread, user space only so that the
+// default kernel.perf_event_paranoid=2 still allows them. Members the CPU or
+// hypervisor does not provide are left out of the group.
+class PerfGroup {
+public:
+    static constexpr int count = 4;
+
+    bool open() {
+        const std::uint64_t configs[count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                              PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < count; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fd < 0) {
+                if (error.empty()) {
+                    error = errno == ENOENT ? "this CPU or VM exposes none" : std::strerror(errno);
+                    denied = errno == EACCES || errno == EPERM;
+                }
+                continue;
+            }
+            if (leader < 0) leader = fd;
+            slots.push_back(i);
+        }
+        return leader >= 0;
+    }
+
+    void start() {
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    // Fills values[] (in open()'s order) and sets have[] for the counters
+    // that exist, scaled up if the kernel had to multiplex them.
+    void stop(std::uint64_t values[count], bool have[count]) {
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        std::uint64_t buf[3 + count] = {};
+        if (read(leader, buf, sizeof buf) < static_cast<ssize_t>(3 * sizeof(std::uint64_t))) return;
+        double scale = buf[2] ? static_cast<double>(buf[1]) / buf[2] : 0;
+        for (std::size_t i = 0; i < slots.size() && i < buf[0]; i++) {
+            values[slots[i]] = static_cast<std::uint64_t>(buf[3 + i] * scale);
+            have[slots[i]] = true;
+        }
+    }
+
+    std::string error;
+    bool denied = false;
+
+private:
+    int leader = -1;
+    std::vector<int> slots;
+};
+#endif
+
+#ifdef POLYGLOT_ALLOC_STATS
+// Built with -DPOLYGLOT_ALLOC_STATS, every operator new and delete is
+// counted, per thread for --stats' phases and for the whole process. Each
+// block carries its size in a header so delete can take it off again.
+// Over-aligned new and plain malloc (the embedded interpreters) are not
+// counted.
+namespace allocstats {
+
+struct Counters {
+    std::uint64_t allocs;
+    std::uint64_t bytes;
+    std::int64_t live;
+    std::int64_t peak;
+};
+
+// Blocks freed by another thread than the one that allocated them can
+// take a thread's live count below zero; only differences are reported.
+thread_local Counters thread;
+std::atomic<std::uint64_t> allocs{0};
+std::atomic<std::uint64_t> bytes{0};
+std::atomic<std::int64_t> live{0};
+std::atomic<std::int64_t> peak{0};
+
+constexpr std::size_t header = alignof(std::max_align_t);
+
+void* allocate(std::size_t n) noexcept {
+    void* block = std::malloc(n + header);
+    if (!block) return nullptr;
+    *static_cast<std::size_t*>(block) = n;
+    const std::int64_t size = static_cast<std::int64_t>(n);
+    thread.allocs++;
+    thread.bytes += n;
+    thread.live += size;
+    thread.peak = std::max(thread.peak, thread.live);
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(n, std::memory_order_relaxed);
+    std::int64_t now = live.fetch_add(size, std::memory_order_relaxed) + size;
+    for (std::int64_t top = peak.load(std::memory_order_relaxed);
+         now > top && !peak.compare_exchange_weak(top, now, std::memory_order_relaxed);) {}
+    return static_cast<char*>(block) + header;
+}
+
+void release(void* p) noexcept {
+    if (!p) return;
+    void* block = static_cast<char*>(p) - header;
+    const std::int64_t size = static_cast<std::int64_t>(*static_cast<std::size_t*>(block));
+    thread.live -= size;
+    live.fetch_sub(size, std::memory_order_relaxed);
+    std::free(block);
+}
+
+void* allocateOrThrow(std::size_t n) {
+    void* p = allocate(n);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+} // namespace allocstats
+
+void* operator new(std::size_t n) { return allocstats::allocateOrThrow(n); }
+void* operator new[](std::size_t n) { return allocstats::allocateOrThrow(n); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept { return allocstats::allocate(n); }
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept { return allocstats::allocate(n); }
+void operator delete(void* p) noexcept { allocstats::release(p); }
+void operator delete[](void* p) noexcept { allocstats::release(p); }
+void operator delete(void* p, std::size_t) noexcept { allocstats::release(p); }
+void operator delete[](void* p, std::size_t) noexcept { allocstats::release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { allocstats::release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { allocstats::release(p); }
+#endif
+
+// --stats: wall and CPU time per phase of this process, hardware counters
+// where the kernel allows them, bytes handled, allocations when built with
+// POLYGLOT_ALLOC_STATS, and the CPU time of the checkers it spawned (from
+// wait4), printed to stderr at the end.
+class Stats {
+public:
+    static Stats& instance() {
+        static Stats stats;
+        return stats;
+    }
+
+    struct Row {
+        std::string name;
+        double wallMs = 0;
+        double cpuMs = 0;
+        std::uint64_t counters[4] = {};
+        bool have[4] = {};
+        std::uint64_t bytes = 0;
+        std::uint64_t allocs = 0;
+        std::uint64_t allocBytes = 0;
+        std::int64_t peakLive = 0;
+    };
+
+    // Measures one phase on the calling thread while --stats is on.
+    class Phase {
+    public:
+        explicit Phase(const char* name) : on(instance().enabled) {
+            if (!on) return;
+            row.name = name;
+            instance().startPhase();
+#ifdef POLYGLOT_ALLOC_STATS
+            allocStart = allocstats::thread;
+            allocstats::thread.peak = allocstats::thread.live;
+#endif
+            wallStart = std::chrono::steady_clock::now();
+            cpuStart = threadCpuMs();
+        }
+        ~Phase() {
+            if (!on) return;
+            row.cpuMs = threadCpuMs() - cpuStart;
+            row.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+#ifdef POLYGLOT_ALLOC_STATS
+            const allocstats::Counters now = allocstats::thread;
+            row.allocs = now.allocs - allocStart.allocs;
+            row.allocBytes = now.bytes - allocStart.bytes;
+            row.peakLive = now.peak - allocStart.live;
+#endif
+            instance().endPhase(row);
+        }
+        Phase(const Phase&) = delete;
+        Phase& operator=(const Phase&) = delete;
+
+        void addBytes(std::uint64_t n) { row.bytes += n; }
+
+    private:
+        friend class Stats;
+        bool on;
+        Row row;
+        std::chrono::steady_clock::time_point wallStart;
+        double cpuStart = 0;
+#ifdef POLYGLOT_ALLOC_STATS
+        allocstats::Counters allocStart{};
+#endif
+    };
+
+    bool enabled = false;
+
+#ifdef POLYGLOT_POSIX
+    void addChild(const struct rusage& usage) {
+        std::lock_guard<std::mutex> lock(mtx);
+        children++;
+        childUserMs += usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+        childSysMs += usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+        childMaxRssKb = std::max(childMaxRssKb, maxRssKb(usage));
+    }
+
+    static long maxRssKb(const struct rusage& usage) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+
+    void report(std::ostream& out) const {
+        const char* const counterNames[] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+        out << "polyglot stats:\n" << std::left << std::setw(8) << "phase" << std::right
+            << std::setw(10) << "wall ms" << std::setw(10) << "cpu ms";
+        for (const char* name : counterNames) out << std::setw(15) << name;
+        out << std::setw(12) << "bytes";
+#ifdef POLYGLOT_ALLOC_STATS
+        out << std::setw(10) << "allocs" << std::setw(14) << "alloc bytes" << std::setw(12) << "peak live";
+#endif
+        out << "\n";
+        for (const Row& r : rows) {
+            out << std::left << std::setw(8) << r.name << std::right << std::fixed << std::setprecision(2)
+                << std::setw(10) << r.wallMs << std::setw(10) << r.cpuMs;
+            for (int i = 0; i < 4; i++) {
+                if (r.have[i]) out << std::setw(15) << r.counters[i];
+                else out << std::setw(15) << "-";
+            }
+            out << std::setw(12) << r.bytes;
+#ifdef POLYGLOT_ALLOC_STATS
+            out << std::setw(10) << r.allocs << std::setw(14) << r.allocBytes << std::setw(12) << r.peakLive;
+#endif
+            out << "\n";
+        }
+#ifdef POLYGLOT_POSIX
+        // polyglot alone; the checkers are on the next line.
+        struct rusage self;
+        if (getrusage(RUSAGE_SELF, &self) == 0) out << "process: max RSS " << maxRssKb(self) << " KB\n";
+#endif
+        out << "checkers: " << children << " spawned, user " << childUserMs << " ms, sys " << childSysMs
+            << " ms, max RSS " << childMaxRssKb << " KB\n";
+#ifdef POLYGLOT_ALLOC_STATS
+        // All threads, including the checker threads' reads of tool output.
+        out << "allocations: " << allocstats::allocs.load() << " allocs, " << allocstats::bytes.load()
+            << " bytes, peak live " << allocstats::peak.load() << " bytes\n";
+#endif
+        if (!countersError.empty()) out << "hardware counters unavailable: " << countersError << "\n";
+        out.unsetf(std::ios::fixed);
+    }
+
+private:
+    static double threadCpuMs() {
+#ifdef POLYGLOT_POSIX
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#else
+        return std::clock() * 1e3 / CLOCKS_PER_SEC;
+#endif
+    }
+
+    void startPhase() {
+#ifdef __linux__
+        if (!perfTried) {
+            perfTried = true;
+            if (!perf.open()) {
+                countersError = perf.error;
+                std::ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+                if (perf.denied && paranoid) {
+                    std::string level;
+                    paranoid >> level;
+                    countersError += " (kernel.perf_event_paranoid = " + level + ")";
+                }
+            }
+        }
+        if (countersError.empty()) perf.start();
+#endif
+    }
+
+    void endPhase(Row& row) {
+#ifdef __linux__
+        if (countersError.empty()) perf.stop(row.counters, row.have);
+#else
+        if (countersError.empty()) countersError = "perf_event_open is Linux only";
+#endif
+        rows.push_back(row);
+    }
+
+    std::vector<Row> rows;
+    std::string countersError;
+#ifdef __linux__
+    PerfGroup perf;
+    bool perfTried = false;
+#endif
+    std::mutex mtx;
+    unsigned children = 0;
+    double childUserMs = 0;
+    double childSysMs = 0;
+    long childMaxRssKb = 0;
+};
+
+// Appends every spawned command to $POLYGLOT_SPAWN_LOG; the benchmark in
+// test_runner counts the lines.
+static void logSpawn(const std::string& cmd) {
+    static const char* path = std::getenv("POLYGLOT_SPAWN_LOG");
+    static std::mutex logMutex;
+    if (!path) return;
+    std::lock_guard<std::mutex> lock(logMutex);
+    std::ofstream(path, std::ios::app) << cmd << "\n";
+}
+
 std::string runCmd(const std::string& cmd) {
-    std::array<char, 256> buffer;
+    auto slot = JobServer::instance().acquire();
+    logSpawn(cmd);
     std::string result;
+#ifdef POLYGLOT_POSIX
+    // fork/exec rather than popen, so wait4 can report the child's CPU time.
+    int fds[2];
+#ifdef __linux__
+    if (pipe2(fds, O_CLOEXEC) != 0) throw std::runtime_error("pipe() failed!");
+#else
+    if (pipe(fds) != 0) throw std::runtime_error("pipe() failed!");
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        throw std::runtime_error("fork() failed!");
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        // Undo PendingOutput::removeOnSignals, so ^C still stops the checker.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(fds[1]);
+    std::array<char, 4096> buffer;
+    for (;;) {
+        ssize_t n = read(fds[0], buffer.data(), buffer.size());
+        if (n > 0) result.append(buffer.data(), n);
+        else if (n == 0 || errno != EINTR) break;
+    }
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return result;
+    }
+    Stats::instance().addChild(usage);
+#else
+    std::array<char, 256> buffer;
     std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
     if (!pipe) throw std::runtime_error("popen() failed!");
     while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr)
         result += buffer.data();
+#endif
     return result;
 }
 
@@ -54,15 +624,526 @@ std::string replace(const std::string& str, const std::string& replace, const st
     return result;
 }
 
-bool checkSyntax(const std::string& file, const std::string& ext) {
+static bool isCppExt(const std::string& ext) {
+    return ext == ".cpp" || ext == ".cc" || ext == ".cxx" || ext == ".c";
+}
+
+// Checker slots shared by every polyglot process of this user, so that a
+// make -j64 of merges stays within one memory budget and one g++ cap
+// instead of one per process. Each slot is a byte of a lock file, taken
+// with a non-blocking fcntl lock; the kernel drops a process's locks when
+// it exits, however it exits. Bytes [0, units) are memory, unitMb each,
+// and every language has a range of its own for its cap. Without POSIX
+// locks, or if the file cannot be used safely, limits stay per process.
+class SharedSlots {
+public:
+    static constexpr std::uint64_t unitMb = 64;
+
+    static SharedSlots& instance() {
+        static SharedSlots slots;
+        return slots;
+    }
+
+    // Takes `count` free bytes of [base, base + range) into `taken`, or
+    // none of them; returns whether it did.
+    bool tryTake(std::uint64_t base, std::uint64_t range, std::uint64_t count, std::vector<std::uint64_t>& taken) {
+#ifdef POLYGLOT_POSIX
+        if (fd < 0 || count == 0) return true;
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<std::uint64_t> got;
+        for (std::uint64_t b = base; b < base + range && got.size() < count; b++) {
+            // Locks never conflict within one process, so our own bytes are
+            // tracked here.
+            if (mine.count(b) || !setLock(b, F_WRLCK)) continue;
+            mine.insert(b);
+            got.push_back(b);
+        }
+        if (got.size() < count) {
+            unlock(got);
+            return false;
+        }
+        taken.insert(taken.end(), got.begin(), got.end());
+#else
+        (void)base;
+        (void)range;
+        (void)count;
+        (void)taken;
+#endif
+        return true;
+    }
+
+    void give(const std::vector<std::uint64_t>& bytes) {
+#ifdef POLYGLOT_POSIX
+        std::lock_guard<std::mutex> lock(mtx);
+        unlock(bytes);
+#else
+        (void)bytes;
+#endif
+    }
+
+private:
+    SharedSlots() {
+#ifdef POLYGLOT_POSIX
+        const char* dir = std::getenv("XDG_RUNTIME_DIR");
+        std::string path = std::string(dir && *dir ? dir : "/tmp") + "/polyglot-" + std::to_string(geteuid()) + ".slots";
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+        struct stat st;
+        if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid())) {
+            close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+#ifdef POLYGLOT_POSIX
+    bool setLock(std::uint64_t byte, short type) {
+        struct flock fl;
+        std::memset(&fl, 0, sizeof fl);
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = static_cast<off_t>(byte);
+        fl.l_len = 1;
+        return fcntl(fd, F_SETLK, &fl) == 0;
+    }
+
+    void unlock(const std::vector<std::uint64_t>& bytes) {
+        for (std::uint64_t b : bytes) {
+            setLock(b, F_UNLCK);
+            mine.erase(b);
+        }
+    }
+
+    int fd = -1;
+    std::mutex mtx;
+    std::set<std::uint64_t> mine;
+#endif
+};
+
+// Admits external checkers by language before they take a job slot. Each
+// language can have a concurrency cap, and each checker's estimated peak
+// memory must fit in a budget shared by all of them; one that is too big on
+// its own still runs, alone. Waiting checkers are admitted cheapest first,
+// so `bash -n` and friends drain while g++ waits for memory to free up.
+// Once admitted here, a checker also takes its memory and cap from
+// SharedSlots, which other polyglot processes draw on too.
+class CheckScheduler {
+public:
+    struct Limit {
+        unsigned jobs = 0;  // 0: no cap beyond -j
+        std::uint64_t memMb = 0;
+    };
+
+    class Slot {
+    public:
+        Slot(Slot&& other) noexcept
+            : owner(other.owner), lang(std::move(other.lang)), memMb(other.memMb), shared(std::move(other.shared)) {
+            other.owner = nullptr;
+        }
+        Slot& operator=(Slot&&) = delete;
+        ~Slot() { if (owner) owner->release(*this); }
+
+    private:
+        friend class CheckScheduler;
+        Slot(CheckScheduler* owner, std::string lang, std::uint64_t memMb)
+            : owner(owner), lang(std::move(lang)), memMb(memMb) {}
+        CheckScheduler* owner;
+        std::string lang;
+        std::uint64_t memMb;
+        std::vector<std::uint64_t> shared;  // bytes held in SharedSlots
+    };
+
+    static CheckScheduler& instance() {
+        static CheckScheduler scheduler;
+        return scheduler;
+    }
+
+    // Language keys: cpp (g++, also for .c/.cc/.cxx), py, rb, sh, pl.
+    static std::string language(const std::string& ext) {
+        return isCppExt(ext) ? "cpp" : ext.empty() ? ext : ext.substr(1);
+    }
+
+    bool knows(const std::string& lang) const { return limits.count(lang) != 0; }
+
+    void setLimit(const std::string& lang, unsigned jobs, std::optional<std::uint64_t> memMb) {
+        limits[lang].jobs = jobs;
+        if (memMb) limits[lang].memMb = *memMb;
+    }
+
+    void setBudget(std::uint64_t mb) { budgetMb = mb; }
+
+    // A place in the queue, taken when a check is launched so that the
+    // whole batch is known before anything is admitted. wait() blocks until
+    // it is this check's turn; dropping the ticket unused gives up the place.
+    class Ticket {
+    public:
+        Ticket(Ticket&& other) noexcept : owner(other.owner), seq(other.seq) { other.owner = nullptr; }
+        Ticket& operator=(Ticket&&) = delete;
+        ~Ticket() { if (owner) owner->cancel(seq); }
+
+        Slot wait() {
+            CheckScheduler* scheduler = owner;
+            owner = nullptr;
+            Slot slot = scheduler->admit(seq);
+            scheduler->claimShared(slot);
+            return slot;
+        }
+
+    private:
+        friend class CheckScheduler;
+        Ticket(CheckScheduler* owner, std::uint64_t seq) : owner(owner), seq(seq) {}
+        CheckScheduler* owner;
+        std::uint64_t seq;
+    };
+
+    Ticket enqueue(const std::string& lang) {
+        std::lock_guard<std::mutex> lock(mtx);
+        waiting.push_back({lang, limits[lang].memMb, nextSeq});
+        return Ticket(this, nextSeq++);
+    }
+
+private:
+    struct Waiter {
+        std::string lang;
+        std::uint64_t memMb;
+        std::uint64_t seq;
+    };
+
+    // Peak RSS guesses for one check of a typical source; g++ dominates.
+    CheckScheduler() : budgetMb(defaultBudgetMb()) {
+        limits["cpp"].memMb = 1024;
+        limits["py"].memMb = 64;
+        limits["rb"].memMb = 64;
+        limits["pl"].memMb = 32;
+        limits["sh"].memMb = 8;
+    }
+
+    // Three quarters of the memory available at startup, or no budget if
+    // that cannot be read.
+    static std::uint64_t defaultBudgetMb() {
+        std::uint64_t availableKb = 0;
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        std::uint64_t value;
+        while (meminfo >> key >> value) {
+            if (key == "MemAvailable:") availableKb = value;
+            meminfo.ignore(256, '\n');
+        }
+#ifdef POLYGLOT_POSIX
+        if (!availableKb) {
+            long pages = sysconf(_SC_PHYS_PAGES);
+            long pageSize = sysconf(_SC_PAGESIZE);
+            if (pages > 0 && pageSize > 0) availableKb = static_cast<std::uint64_t>(pages) * pageSize / 1024;
+        }
+#endif
+        return availableKb ? availableKb / 1024 * 3 / 4 : UINT64_MAX;
+    }
+
+    bool fits(const Waiter& w) {
+        const Limit& limit = limits[w.lang];
+        if (limit.jobs && running[w.lang] >= limit.jobs) return false;
+        return runningTotal == 0 || usedMb + w.memMb <= budgetMb;
+    }
+
+    Slot admit(std::uint64_t seq) {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return chosen() == seq; });
+        auto me = std::find_if(waiting.begin(), waiting.end(), [&](const Waiter& w) { return w.seq == seq; });
+        Slot slot(this, me->lang, me->memMb);
+        waiting.erase(me);
+        running[slot.lang]++;
+        runningTotal++;
+        usedMb += slot.memMb;
+        // Whoever is next may fit as well.
+        cv.notify_all();
+        return slot;
+    }
+
+    void cancel(std::uint64_t seq) {
+        std::lock_guard<std::mutex> lock(mtx);
+        waiting.erase(std::find_if(waiting.begin(), waiting.end(), [&](const Waiter& w) { return w.seq == seq; }));
+        cv.notify_all();
+    }
+
+    // The cheapest waiter that can start now, oldest first among equals.
+    std::uint64_t chosen() {
+        const Waiter* best = nullptr;
+        for (const Waiter& w : waiting) {
+            if (!fits(w)) continue;
+            if (!best || w.memMb < best->memMb || (w.memMb == best->memMb && w.seq < best->seq)) best = &w;
+        }
+        return best ? best->seq : UINT64_MAX;
+    }
+
+    // Polls until SharedSlots has room: a language's cap, then memory.
+    // Holding every unit is the cross-process form of running alone.
+    void claimShared(Slot& slot) {
+        std::uint64_t jobs, units;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs = limits[slot.lang].jobs;
+            units = budgetMb == UINT64_MAX ? 0 : std::max<std::uint64_t>(1, budgetMb / SharedSlots::unitMb);
+        }
+        std::uint64_t need = std::min(units, (slot.memMb + SharedSlots::unitMb - 1) / SharedSlots::unitMb);
+        // Memory units stay below 2^24, and each cap gets 2^16 bytes above
+        // that, which keeps every offset within a 32-bit off_t.
+        const char* const langs[] = {"cpp", "py", "rb", "sh", "pl"};
+        std::uint64_t langIndex = std::find(std::begin(langs), std::end(langs), slot.lang) - std::begin(langs);
+        const std::uint64_t capBase = (std::uint64_t{1} << 24) + langIndex * (std::uint64_t{1} << 16);
+        units = std::min(units, std::uint64_t{1} << 24);
+        jobs = std::min(jobs, std::uint64_t{1} << 16);
+        SharedSlots& shared = SharedSlots::instance();
+        for (;;) {
+            std::vector<std::uint64_t> taken;
+            if (shared.tryTake(capBase, jobs, jobs ? 1 : 0, taken)) {
+                if (shared.tryTake(0, units, need, taken)) {
+                    slot.shared = std::move(taken);
+                    return;
+                }
+                shared.give(taken);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    void release(const Slot& slot) {
+        SharedSlots::instance().give(slot.shared);
+        std::lock_guard<std::mutex> lock(mtx);
+        running[slot.lang]--;
+        runningTotal--;
+        usedMb -= slot.memMb;
+        cv.notify_all();
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, Limit> limits;
+    std::map<std::string, unsigned> running;
+    std::vector<Waiter> waiting;
+    unsigned runningTotal = 0;
+    std::uint64_t usedMb = 0;
+    std::uint64_t budgetMb;
+    std::uint64_t nextSeq = 0;
+};
+
+#ifdef POLYGLOT_EMBED
+// Interpreters linked into polyglot check guest code without spawning
+// anything. None of them may be entered from more than one thread, so a
+// single worker owns them all and runs the checks in turn. Python and Ruby
+// start on first use and are reused after that.
+class Embedded {
+public:
+    static Embedded& instance() {
+        // Never destroyed: the worker is still waiting when main() returns.
+        static Embedded* embedded = new Embedded;
+        return *embedded;
+    }
+
+    std::optional<bool> check(const std::string& file, const std::string& ext, std::ostream& diag) {
+        auto task = std::make_shared<std::packaged_task<std::optional<bool>()>>(
+            [&] { return dispatch(file, ext, diag); });
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            queue.push_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result.get();
+    }
+
+private:
+    Embedded() {
+        std::thread([this] { serve(); }).detach();
+    }
+
+    void serve() {
+#ifdef POLYGLOT_EMBED_RUBY
+        // Ruby's GC scans this thread's stack from here down.
+        RUBY_INIT_STACK;
+#endif
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return !queue.empty(); });
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::optional<bool> dispatch(const std::string& file, const std::string& ext, std::ostream& diag) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in.is_open()) return std::nullopt;
+        std::ostringstream text;
+        text << in.rdbuf();
+#ifdef POLYGLOT_EMBED_PYTHON
+        if (ext == ".py") return checkPython(file, text.str(), diag);
+#endif
+#ifdef POLYGLOT_EMBED_RUBY
+        if (ext == ".rb") return checkRuby(file, text.str(), diag);
+#endif
+#ifdef POLYGLOT_EMBED_PERL
+        if (ext == ".pl") return checkPerl(file, text.str(), diag);
+#endif
+        return std::nullopt;
+    }
+
+#ifdef POLYGLOT_EMBED_PYTHON
+    // Compiles without running, like py_compile.
+    std::optional<bool> checkPython(const std::string& file, const std::string& src, std::ostream& diag) {
+        if (src.find('\0') != std::string::npos) return std::nullopt;
+        if (!Py_IsInitialized()) {
+            Py_InitializeEx(0);
+            if (!Py_IsInitialized()) return std::nullopt;
+        }
+        PyObject* code = Py_CompileStringExFlags(src.c_str(), file.c_str(), Py_file_input, nullptr, -1);
+        if (code) {
+            Py_DECREF(code);
+            return true;
+        }
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        PyObject* msg = value ? PyObject_Str(value) : nullptr;
+        const char* text = msg ? PyUnicode_AsUTF8(msg) : nullptr;
+        diag << "Python syntax errors in " << file << ":\n" << (text ? text : "compile failed") << "\n";
+        Py_XDECREF(msg);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+        PyErr_Clear();
+        return false;
+    }
+#endif
+
+#ifdef POLYGLOT_EMBED_RUBY
+    static VALUE rubyCompile(VALUE args) {
+        VALUE iseq = rb_path2class("RubyVM::InstructionSequence");
+        return rb_funcall(iseq, rb_intern("compile"), 2, rb_ary_entry(args, 0), rb_ary_entry(args, 1));
+    }
+
+    // Compiles to bytecode without running, which reports the same errors as
+    // `ruby -c`.
+    std::optional<bool> checkRuby(const std::string& file, const std::string& src, std::ostream& diag) {
+        if (!rubyStarted) {
+            if (ruby_setup() != 0) return std::nullopt;
+            ruby_init_loadpath();
+            rubyStarted = true;
+        }
+        VALUE args = rb_ary_new_from_args(2, rb_utf8_str_new(src.data(), src.size()),
+                                          rb_utf8_str_new_cstr(file.c_str()));
+        int state = 0;
+        rb_protect(rubyCompile, args, &state);
+        if (state == 0) return true;
+        VALUE msg = rb_funcall(rb_errinfo(), rb_intern("message"), 0);
+        rb_set_errinfo(Qnil);
+        diag << "Ruby syntax errors in " << file << ":\n" << std::string(RSTRING_PTR(msg), RSTRING_LEN(msg)) << "\n";
+        return false;
+    }
+
+    bool rubyStarted = false;
+#endif
+
+#ifdef POLYGLOT_EMBED_PERL
+    static void perlXsInit(pTHX) {
+        newXS("DynaLoader::boot_DynaLoader", boot_DynaLoader, __FILE__);
+    }
+
+    // Compiles without running, like `perl -c`: BEGIN blocks and `use` still
+    // run, but END blocks do not. Unlike the other two, every file gets a
+    // fresh interpreter, because prototypes and packages declared by one
+    // file would change how the next one parses.
+    std::optional<bool> checkPerl(const std::string& file, const std::string& src, std::ostream& diag) {
+        if (file.find_first_of("\"\n") != std::string::npos) return std::nullopt;
+        if (!perlStarted) {
+            int argc = 0;
+            char** argv = nullptr;
+            char** env = nullptr;
+            PERL_SYS_INIT3(&argc, &argv, &env);
+            perlStarted = true;
+        }
+        // Guest BEGIN blocks must not print to our stdout or exit polyglot.
+        const char* args[] = {"perl", "-e",
+            "BEGIN { open my $sink, '>', \\my $out; select $sink; $SIG{__WARN__} = sub {};"
+            " *CORE::GLOBAL::exit = sub { die \"exit called at compile time\\n\" } }"};
+        PerlInterpreter* my_perl = perl_alloc();
+        if (!my_perl) return std::nullopt;
+        perl_construct(my_perl);
+        PL_perl_destruct_level = 1;
+        std::optional<bool> ok;
+        if (perl_parse(my_perl, perlXsInit, 3, const_cast<char**>(args), nullptr) == 0) {
+            // `return` runs first, so nothing but compile-time code executes.
+            SV* code = newSVpvf("package main; return;\n#line 1 \"%s\"\n", file.c_str());
+            sv_catpvn(code, src.data(), src.size());
+            eval_sv(code, G_SCALAR | G_DISCARD);
+            SvREFCNT_dec(code);
+            ok = !SvTRUE(ERRSV);
+            if (!*ok) diag << "Perl syntax errors in " << file << ":\n" << SvPV_nolen(ERRSV);
+        }
+        perl_destruct(my_perl);
+        perl_free(my_perl);
+        return ok;
+    }
+
+    bool perlStarted = false;
+#endif
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> queue;
+};
+#endif
+
+// Whether polyglot was built with an interpreter for this language. Those
+// checks take no scheduler ticket unless they fall back to the tool.
+bool embedsChecker(const std::string& ext) {
+#ifdef POLYGLOT_EMBED_PYTHON
+    if (ext == ".py") return true;
+#endif
+#ifdef POLYGLOT_EMBED_RUBY
+    if (ext == ".rb") return true;
+#endif
+#ifdef POLYGLOT_EMBED_PERL
+    if (ext == ".pl") return true;
+#endif
+    (void)ext;
+    return false;
+}
+
+// Checks the file in-process when polyglot was built with an interpreter
+// for its language. Returns std::nullopt otherwise, and checkSyntax spawns
+// the external tool instead.
+std::optional<bool> checkEmbedded(const std::string& file, const std::string& ext, std::ostream& diag) {
+#ifdef POLYGLOT_EMBED
+    return Embedded::instance().check(file, ext, diag);
+#else
+    (void)file;
+    (void)ext;
+    (void)diag;
+    return std::nullopt;
+#endif
+}
+
+bool checkSyntax(const std::string& file, const std::string& ext, std::ostream& diag,
+                 std::optional<CheckScheduler::Ticket> ticket = std::nullopt) {
+    if (embedsChecker(ext)) {
+        // A queued ticket would hold up the checkers behind it for as long
+        // as the interpreter runs.
+        ticket.reset();
+        if (std::optional<bool> ok = checkEmbedded(file, ext, diag)) return *ok;
+    }
+
+    if (!ticket) ticket.emplace(CheckScheduler::instance().enqueue(CheckScheduler::language(ext)));
+    auto slot = ticket->wait();
     std::string res;
     std::string quoted = shellSafePath(file);
 
-    if (ext == ".cpp" || ext == ".cc" || ext == ".cxx" || ext == ".c") {
+    if (isCppExt(ext)) {
         std::string flag = ext == ".c" ? "-x c " : "";
         res = runCmd("g++ -fsyntax-only " + flag + quoted + " 2>&1");
         if (!res.empty()) {
-            std::cerr << "C/C++ syntax errors in " << file << ":\n" << res;
+            diag << "C/C++ syntax errors in " << file << ":\n" << res;
             return false;
         }
         return true;
@@ -70,14 +1151,14 @@ bool checkSyntax(const std::string& file, const std::string& ext) {
         try {
             res = runCmd("python3 -m pyflakes " + quoted + " 2>&1");
         } catch (const std::exception& x) {
-            std::cerr << "\033[31m" << "Error: " << x.what() << "\033[0m" << std::endl;
+            diag << "\033[31m" << "Error: " << x.what() << "\033[0m" << std::endl;
             res = x.what();
         }
         if (!res.empty()) {
             std::string fallback = runCmd("python -m py_compile " + quoted + " 2>&1");
             if (!fallback.empty()) {
-                std::cerr << "Python syntax errors in " << file << ":\n" << fallback;
-                std::cerr << "If pyflakes is desired, please install it or ensure it's on PATH.\n";
+                diag << "Python syntax errors in " << file << ":\n" << fallback;
+                diag << "If pyflakes is desired, please install it or ensure it's on PATH.\n";
                 return false;
             }
         }
@@ -85,120 +1166,1150 @@ bool checkSyntax(const std::string& file, const std::string& ext) {
     } else if (ext == ".rb") {
         res = runCmd("ruby -c " + quoted + " 2>&1");
         if (res.find("Syntax OK") == std::string::npos) {
-            std::cerr << "Ruby syntax errors in " << file << ":\n" << res;
+            diag << "Ruby syntax errors in " << file << ":\n" << res;
             return false;
         }
         return true;
     } else if (ext == ".sh") {
         res = runCmd("bash -n " + quoted + " 2>&1");
         if (!res.empty()) {
-            std::cerr << "Bash syntax errors in " << file << ":\n" << res;
+            diag << "Bash syntax errors in " << file << ":\n" << res;
             return false;
         }
         return true;
     } else if (ext == ".pl") {
         res = runCmd("perl -c " + quoted + " 2>&1");
         if (res.find("syntax OK") == std::string::npos) {
-            std::cerr << "Perl syntax errors in " << file << ":\n" << res;
+            diag << "Perl syntax errors in " << file << ":\n" << res;
             return false;
         }
         return true;
     }
 
-    std::cerr << "\nUnsupported file extension: " << ext << "\n";
+    diag << "\nUnsupported file extension: " << ext << "\n";
     return false;
 }
 
-std::vector<std::string> readFile(const std::string& filename) {
-    std::ifstream in(filename);
-    if (!in.is_open()) throw std::runtime_error("Failed to open: " + filename);
+// Splits like std::getline: '\n' ends a line, a final newline does not
+// start an empty one, and '\r' is kept.
+std::vector<std::string> splitLines(const std::string& text) {
     std::vector<std::string> lines;
-    std::string line;
-    while (std::getline(in, line)) lines.push_back(line);
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t end = text.find('\n', start);
+        if (end == std::string::npos) end = text.size();
+        lines.emplace_back(text, start, end - start);
+        start = end + 1;
+    }
     return lines;
 }
 
+std::vector<std::string> readFile(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) throw std::runtime_error("Failed to open: " + filename);
+    std::ostringstream text;
+    text << in.rdbuf();
+    return splitLines(text.str());
+}
+
+// Fences hide the C/C++ half from the guest interpreter. Bash gets a quoted
+// heredoc so quotes in the C/C++ code cannot end it.
+std::string openFence(const std::string& ext) {
+    if (ext == ".py") return "r'''";
+    if (ext == ".rb") return "=begin";
+    if (ext == ".sh") return ": <<'POLYGLOT_EOF'";
+    if (ext == ".pl") return "=pod";
+    return "";
+}
+
+std::string closeFence(const std::string& ext) {
+    if (ext == ".py") return "'''";
+    if (ext == ".rb") return "=end";
+    if (ext == ".sh") return "POLYGLOT_EOF";
+    if (ext == ".pl") return "=cut";
+    return "";
+}
+
+// Rejects C/C++ lines that would end the guest's fence early. Python's
+// fence is handled by escapeForPython instead.
+static void checkHostLine(const std::string& guestExt, const std::string& line, std::size_t lineNo) {
+    const std::string close = closeFence(guestExt);
+    bool ends = false;
+    if (guestExt == ".rb" || guestExt == ".pl") ends = line.rfind(close, 0) == 0;
+    else if (guestExt == ".sh") ends = line == close;
+    if (ends) {
+        throw std::runtime_error("line " + std::to_string(lineNo) + " of the C/C++ source would end the "
+                                 + guestExt + " fence (" + close + ")");
+    }
+}
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\f' || c == '\v';
+}
+
+static bool isIdentChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '_' || c == '$' || static_cast<unsigned char>(c) >= 0x80;
+}
+
+// A ''' that Python sees in the C/C++ code would close the r''' literal
+// early. Python skips the character after a backslash there, so \''' is no
+// such place and stays as it is. Inside a C/C++ string, character literal
+// or comment \' means the same as ', and the quotes become \'\'\'. A raw
+// string takes the backslash literally, and anywhere else the quotes are
+// part of the code, so a ''' there is rejected. `cplusplus` is false for a
+// .c host, as when merging.
+std::vector<std::string> escapeForPython(const std::vector<std::string>& lines, bool cplusplus) {
+    std::string text;
+    for (const std::string& line : lines) text += line + '\n';
+
+    // Phases 1-2 as in scanSkippedGroup; at maps what is left back to text.
+    std::string src;
+    std::vector<std::size_t> at;
+    for (std::size_t i = 0; i < text.size();) {
+        char c = text[i];
+        if (c == '\\') {
+            std::size_t j = i + 1;
+            while (j < text.size() && isBlank(text[j])) j++;
+            if (j < text.size() && (text[j] == '\n' || text[j] == '\r')) {
+                if (text[j] == '\r' && j + 1 < text.size() && text[j + 1] == '\n') j++;
+                i = j + 1;
+                continue;
+            }
+        }
+        if (c == '\r' && i + 1 < text.size() && text[i + 1] == '\n') {
+            i++;
+            continue;
+        }
+        src += c == '\r' ? '\n' : c;
+        at.push_back(i);
+        i++;
+    }
+
+    // Phase 3, only as far as needed to know what each character is part of.
+    enum Where : char { InCode, InText, InRaw };
+    std::string where(text.size(), InCode);
+    const std::size_t n = src.size();
+    const std::size_t npos = std::string::npos;
+    auto mark = [&](std::size_t from, std::size_t to, Where w) {
+        for (std::size_t k = from; k < std::min(to, n); k++) where[at[k]] = w;
+    };
+    for (std::size_t i = 0; i < n;) {
+        char c = src[i];
+        char next = i + 1 < n ? src[i + 1] : '\0';
+        if (c == '/' && next == '/') {
+            std::size_t end = src.find('\n', i + 2);
+            mark(i + 2, end, InText);
+            i = std::min(end, n);
+        } else if (c == '/' && next == '*') {
+            std::size_t end = src.find("*/", i + 2);
+            mark(i + 2, end, InText);
+            i = end == npos ? n : end + 2;
+        } else if (c == '"' || c == '\'') {
+            // An unterminated literal stops at the end of the line.
+            std::size_t j = i + 1;
+            while (j < n && src[j] != '\n' && src[j] != c) j += src[j] == '\\' && j + 1 < n && src[j + 1] != '\n' ? 2 : 1;
+            mark(i + 1, j, InText);
+            i = j < n && src[j] == c ? j + 1 : j;
+        } else if ((c >= '0' && c <= '9') || (c == '.' && next >= '0' && next <= '9')) {
+            // pp-number, with C++14 digit separators.
+            for (i++; i < n; i++) {
+                char d = src[i];
+                char prev = src[i - 1];
+                if (((d == '+' || d == '-') && std::strchr("eEpP", prev)) || d == '.' || isIdentChar(d)) continue;
+                if (cplusplus && d == '\'' && i + 1 < n && isIdentChar(src[i + 1])) {
+                    i++;
+                    continue;
+                }
+                break;
+            }
+        } else if (isIdentChar(c)) {
+            std::size_t start = i;
+            while (i < n && isIdentChar(src[i])) i++;
+            std::string id = src.substr(start, i - start);
+            bool rawPrefix = id == "R" || id == "u8R" || id == "uR" || id == "UR" || id == "LR";
+            if (!rawPrefix || i >= n || src[i] != '"') continue;
+            std::size_t open = i + 1;
+            while (open < n && open - (i + 1) < 16 && src[open] != '(' && src[open] != ')'
+                   && src[open] != '\\' && src[open] != '\n' && !isBlank(src[open])
+                   && static_cast<unsigned char>(src[open]) < 0x80) open++;
+            if (open >= n || src[open] != '(') continue;
+            std::string close = ")" + src.substr(i + 1, open - i - 1) + "\"";
+            std::size_t end = src.find(close, open + 1);
+            mark(open + 1, end, InRaw);
+            i = end == npos ? n : end + close.size();
+        } else {
+            i++;
+        }
+    }
+
+    // Python's side, line by line: a backslash at the end escapes the line
+    // break, not the next line.
+    std::vector<std::string> out;
+    out.reserve(lines.size());
+    std::size_t base = 0;
+    for (std::size_t l = 0; l < lines.size(); l++) {
+        const std::string& line = lines[l];
+        std::string escaped;
+        escaped.reserve(line.size());
+        bool pyEscape = false;
+        for (std::size_t i = 0; i < line.size();) {
+            if (pyEscape) {
+                pyEscape = false;
+            } else if (line[i] == '\\') {
+                pyEscape = true;
+            } else if (line.compare(i, 3, "'''") == 0) {
+                std::string_view part(where.data() + base + i, 3);
+                if (part != std::string(3, InText)) {
+                    bool raw = part.find(InRaw) != std::string_view::npos;
+                    throw std::runtime_error("line " + std::to_string(l + 1) + " of the C/C++ source has ''' "
+                                             + (raw ? "in a raw string" : "outside a string or comment")
+                                             + ", which would end the .py fence");
+                }
+                escaped += "\\'\\'\\'";
+                i += 3;
+                continue;
+            }
+            escaped += line[i++];
+        }
+        base += line.size() + 1;
+        out.push_back(std::move(escaped));
+    }
+    return out;
+}
+
+// What the C preprocessor makes of lines inside a skipped `#if 0` group. It
+// still splices lines, strips comments, lexes literals and tracks nested
+// conditionals there, so guest code can end our group early, leave it
+// open, or hide our #endif in a comment.
+struct SkippedGroup {
+    int depth = 0;              // conditionals left open at the end
+    bool inComment = false;     // ends inside /* ... */
+    bool inRawString = false;   // ends inside R"(...)"
+    bool spliced = false;       // ends with backslash-newline
+    std::size_t strayLine = 0;  // 1-based line of an #else/#elif/#endif at depth 0
+    std::string strayDirective;
+};
+
+// `text` is whole lines, each ending in '\n'.
+SkippedGroup scanSkippedGroup(std::string_view text, bool cplusplus) {
+    SkippedGroup g;
+
+    // Phases 1-2: "\r\n" and a lone '\r' end lines as well, and a backslash
+    // followed by blanks and a line break disappears. lineOf maps what is
+    // left back to the original line for error messages.
+    std::string src;
+    std::vector<std::size_t> lineOf;
+    std::size_t lineNo = 1;
+    for (std::size_t i = 0; i < text.size();) {
+        char c = text[i];
+        if (c == '\\') {
+            std::size_t j = i + 1;
+            while (j < text.size() && isBlank(text[j])) j++;
+            if (j < text.size() && (text[j] == '\n' || text[j] == '\r')) {
+                if (text[j] == '\r' && j + 1 < text.size() && text[j + 1] == '\n') j++;
+                if (text[j] == '\n') lineNo++;
+                i = j + 1;
+                g.spliced = i == text.size();
+                continue;
+            }
+        }
+        if (c == '\r' && i + 1 < text.size() && text[i + 1] == '\n') {
+            i++;
+            continue;
+        }
+        src += c == '\r' ? '\n' : c;
+        lineOf.push_back(lineNo);
+        if (c == '\n') lineNo++;
+        i++;
+    }
+
+    // Phases 3-4, reduced to what can open or close a conditional.
+    const std::size_t n = src.size();
+    const std::size_t npos = std::string::npos;
+    bool bol = true;  // nothing but blanks and comments since the last line break
+    auto isDigit = [](char c) { return c >= '0' && c <= '9'; };
+    for (std::size_t i = 0; i < n;) {
+        char c = src[i];
+        char next = i + 1 < n ? src[i + 1] : '\0';
+        if (c == '\n') {
+            bol = true;
+            i++;
+        } else if (isBlank(c)) {
+            i++;
+        } else if (c == '/' && next == '*') {
+            std::size_t end = src.find("*/", i + 2);
+            if (end == npos) {
+                g.inComment = true;
+                return g;
+            }
+            i = end + 2;
+        } else if (c == '/' && next == '/') {
+            i = std::min(src.find('\n', i), n);
+        } else if (bol && (c == '#' || (c == '%' && next == ':'))) {
+            std::size_t hash = i;
+            i += c == '#' ? 1 : 2;
+            for (;;) {
+                while (i < n && isBlank(src[i])) i++;
+                if (i + 1 >= n || src[i] != '/' || src[i + 1] != '*') break;
+                std::size_t end = src.find("*/", i + 2);
+                if (end == npos) {
+                    g.inComment = true;
+                    return g;
+                }
+                i = end + 2;
+            }
+            std::size_t start = i;
+            while (i < n && isIdentChar(src[i])) i++;
+            std::string name = src.substr(start, i - start);
+            if (name == "if" || name == "ifdef" || name == "ifndef") {
+                g.depth++;
+            } else if (name == "else" || name == "elif" || name == "elifdef" || name == "elifndef"
+                       || name == "endif") {
+                if (g.depth == 0) {
+                    g.strayLine = lineOf[hash];
+                    g.strayDirective = "#" + name;
+                    return g;
+                }
+                if (name == "endif") g.depth--;
+            }
+            // Lex the name again as a token: `#R"x(` opens a raw string.
+            i = start;
+            bol = false;
+        } else if (c == '"' || c == '\'') {
+            // An unterminated literal stops at the end of the line, even
+            // right after a backslash.
+            bol = false;
+            for (i++; i < n && src[i] != '\n'; i++) {
+                if (src[i] == '\\' && i + 1 < n && src[i + 1] != '\n') i++;
+                else if (src[i] == c) {
+                    i++;
+                    break;
+                }
+            }
+        } else if (isDigit(c) || (c == '.' && isDigit(next))) {
+            // pp-number, with C++14 digit separators.
+            bol = false;
+            for (i++; i < n; i++) {
+                char d = src[i];
+                char prev = src[i - 1];
+                bool sign = (d == '+' || d == '-')
+                    && (prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P');
+                if (sign || d == '.' || isIdentChar(d)) continue;
+                if (cplusplus && d == '\'' && i + 1 < n && isIdentChar(src[i + 1])) {
+                    i++;
+                    continue;
+                }
+                break;
+            }
+        } else if (isIdentChar(c)) {
+            bol = false;
+            std::size_t start = i;
+            while (i < n && isIdentChar(src[i])) i++;
+            std::string id = src.substr(start, i - start);
+            bool rawPrefix = id == "R" || id == "u8R" || id == "uR" || id == "UR" || id == "LR";
+            if (!rawPrefix || i >= n || src[i] != '"') continue;
+            // Raw string: up to 16 basic delimiter characters, then '('. An invalid
+            // delimiter leaves an ordinary string literal.
+            std::size_t open = i + 1;
+            while (open < n && open - (i + 1) < 16 && src[open] != '(' && src[open] != ')'
+                   && src[open] != '\\' && src[open] != '\n' && !isBlank(src[open])
+                   && static_cast<unsigned char>(src[open]) < 0x80) open++;
+            if (open >= n || src[open] != '(') continue;
+            std::string close = ")" + src.substr(i + 1, open - i - 1) + "\"";
+            std::size_t end = src.find(close, open + 1);
+            if (end == npos) {
+                g.inRawString = true;
+                return g;
+            }
+            i = end + close.size();
+        } else {
+            bol = false;
+            i++;
+        }
+    }
+    return g;
+}
+
+SkippedGroup scanSkippedGroup(const std::vector<std::string>& lines, bool cplusplus) {
+    std::string text;
+    for (const std::string& l : lines) {
+        text += l;
+        text += '\n';
+    }
+    return scanSkippedGroup(text, cplusplus);
+}
+
+// Marks the lines sealGuest appends; a guest may not contain it.
+const std::string sealMarker = "#polyglot: seal";
+
+// Lines appended after the guest code so the C preprocessor's view of the
+// skipped group ends where ours does. Each one is a comment in every guest
+// language. Cases that cannot be repaired from outside are rejected.
+std::vector<std::string> sealGuest(const std::vector<std::string>& guest, bool cplusplus) {
+    for (std::size_t i = 0; i < guest.size(); i++) {
+        if (guest[i] == sealMarker) {
+            throw std::runtime_error("line " + std::to_string(i + 1) + " of the guest source is reserved: "
+                                     + sealMarker);
+        }
+    }
+    SkippedGroup g = scanSkippedGroup(guest, cplusplus);
+    if (!g.strayDirective.empty()) {
+        throw std::runtime_error("line " + std::to_string(g.strayLine) + " of the guest source reads as "
+                                 + g.strayDirective + " to the C preprocessor");
+    }
+    if (g.spliced) {
+        throw std::runtime_error("the guest source ends with a backslash; the C preprocessor would "
+                                 "join it with the closing #endif");
+    }
+    if (g.inRawString) {
+        throw std::runtime_error("the guest source opens a C++ raw string literal that never closes");
+    }
+
+    std::vector<std::string> seal;
+    if (!g.inComment && g.depth == 0) return seal;
+    seal.push_back(sealMarker);
+    if (g.inComment) seal.push_back("#*/");
+    seal.insert(seal.end(), g.depth, "#endif");
+    return seal;
+}
+
+// Compat fences the host off inside the guest script. Fast puts the guest
+// first and ends the script before the host, so the guest interpreter never
+// reads the C/C++ half; it needs a language with an end-of-script marker.
+enum class Layout { Compat, Fast };
+
+// Lines that stop the guest interpreter in the fast layout. A POD block the
+// guest leaves open would hide Perl's __END__, so =pod and =cut come first:
+// =pod opens a block if none is open, and =cut then closes it either way.
+// A bare =cut would open one outside POD and run to the next =cut.
+std::vector<std::string> scriptEnd(const std::string& ext) {
+    if (ext == ".rb") return {"__END__"};
+    if (ext == ".pl") return {"=pod", "=cut", "__END__"};
+    if (ext == ".sh") return {"exit"};
+    return {};
+}
+
+// `#line <n> "<file>"`, with the name escaped as a C string literal.
+std::string lineDirective(std::size_t n, const std::string& file) {
+    std::string line = "#line " + std::to_string(n) + " \"";
+    for (char c : file) {
+        if (c == '\\' || c == '"') line += '\\';
+        if (c == '\n') line += "\\n";
+        else line += c;
+    }
+    return line + "\"";
+}
+
+// Ends the #line directive writeMerged puts before the host, so --extract
+// can tell it from one the host starts with. The preprocessor drops the
+// comment, so -E output does not change.
+const std::string directiveMarker = " /* polyglot */";
+
+// With a hostName, a #line directive makes the compiler see the host under
+// its own name and line numbers. Nothing after the host reaches the
+// compiler, so there is no directive back: it would show up in the
+// preprocessed output, which should only change when the host does.
 void writeMerged(
-    const std::string& outFile,
+    std::ostream& out,
     const std::string& ext1, const std::vector<std::string>& content1,
-    const std::string& ext2, const std::vector<std::string>& content2
+    const std::string& ext2, const std::vector<std::string>& content2,
+    Layout layout = Layout::Compat, const std::string& hostName = ""
 ) {
-    std::ofstream out(outFile, std::ios::binary);
-    if (!out.is_open()) throw std::runtime_error("Failed to open output: " + outFile);
-
-    auto openFence = [](const std::string& ext) -> std::string {
-        if (ext == ".py") return "r'''";
-        if (ext == ".rb") return "=begin";
-        if (ext == ".sh") return ": '";
-        if (ext == ".pl") return "=pod";
-        return "";
-    };
+    if (!isCppExt(ext1) && !isCppExt(ext2)) throw std::runtime_error("No C/C++ file in pair");
+    bool hostFirst = isCppExt(ext1);
+    const std::string& hostExt = hostFirst ? ext1 : ext2;
+    const std::string& guestExt = hostFirst ? ext2 : ext1;
+    const std::vector<std::string>& host = hostFirst ? content1 : content2;
+    const std::vector<std::string>& guest = hostFirst ? content2 : content1;
+    if (openFence(guestExt).empty()) throw std::runtime_error("Unsupported guest language: " + guestExt);
+    const std::vector<std::string> end = scriptEnd(guestExt);
+    if (end.empty()) layout = Layout::Compat;
 
-    auto closeFence = [](const std::string& ext) -> std::string {
-        if (ext == ".py") return "'''";
-        if (ext == ".rb") return "=end";
-        if (ext == ".sh") return "'";
-        if (ext == ".pl") return "=cut";
-        return "";
+    auto writeLine = [&out](const std::string& line) {
+        out.write(line.c_str(), line.size());
+        out.put('\n');
     };
 
+    if (layout == Layout::Fast) {
+        std::vector<std::string> seal = sealGuest(guest, hostExt != ".c");
+        writeLine("#if 0");
+        for (const std::string& l : guest) writeLine(l);
+        for (const std::string& l : seal) writeLine(l);
+        for (const std::string& l : end) writeLine(l);
+        writeLine("#endif");
+        if (!hostName.empty()) writeLine(lineDirective(1, hostName) + directiveMarker);
+        for (const std::string& l : host) writeLine(l);
+        return;
+    }
+
+    // Validate everything before the first byte is written.
+    for (std::size_t i = 0; i < host.size(); i++) checkHostLine(guestExt, host[i], i + 1);
+    std::vector<std::string> directive;
+    if (!hostName.empty()) directive.push_back(lineDirective(1, hostName) + directiveMarker);
+    std::vector<std::string> escaped;
+    if (guestExt == ".py") {
+        escaped = escapeForPython(host, hostExt != ".c");
+        directive = escapeForPython(directive, hostExt != ".c");
+    }
+    const std::vector<std::string>& hostLines = guestExt == ".py" ? escaped : host;
+    std::vector<std::string> seal = sealGuest(guest, hostExt != ".c");
+
     auto escapeCpp = [](const std::string& content) -> std::string {
         return "#if 0\n" + content + "\n#endif\n";
     };
 
-    auto writeLine = [&out](const std::string& line) {
-        out.write(line.c_str(), line.size());
-        out.put('\n');
-    };
+    writeLine(escapeCpp(openFence(guestExt)));
+    for (const std::string& l : directive) writeLine(l);
+    for (const std::string& l : hostLines) writeLine(l);
+    writeLine(escapeCpp(closeFence(guestExt)));
 
-    auto escapeForPython = [](const std::string& line) -> std::string {
-        std::string out;
-        for (size_t i = 0; i < line.size(); i++) {
-            if (i + 2 < line.size() && line[i] == '\'' && line[i+1] == '\'' && line[i+2] == '\'') {
-                out += "\\'\\'\\'";
-                i += 2;
-            } else {
-                out += line[i];
+    writeLine("#if 0");
+    for (const std::string& l : guest) writeLine(l);
+    for (const std::string& l : seal) writeLine(l);
+    writeLine("#endif");
+}
+
+// A whole file, read-only: mapped where mmap exists, read into memory
+// otherwise.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef POLYGLOT_POSIX
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Failed to open: " + path + ": " + std::strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to open: " + path + ": " + std::strerror(errno));
+        }
+        size = static_cast<std::size_t>(st.st_size);
+        if (size > 0) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Failed to map: " + path + ": " + std::strerror(errno));
             }
+            madvise(p, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(p);
+        }
+        close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) throw std::runtime_error("Failed to open: " + path);
+        std::ostringstream text;
+        text << in.rdbuf();
+        buffer = text.str();
+        data = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef POLYGLOT_POSIX
+        if (data) munmap(const_cast<char*>(data), size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const { return std::string_view(data, size); }
+
+private:
+    const char* data = nullptr;
+    std::size_t size = 0;
+#ifndef POLYGLOT_POSIX
+    std::string buffer;
+#endif
+};
+
+// The two halves of a merged file, as views into it. Each is whole lines
+// ending in '\n'; the host still carries escapeForPython's escapes.
+struct SplitMerge {
+    std::string guestExt;
+    Layout layout = Layout::Compat;
+    std::string_view host;
+    std::string_view guest;
+};
+
+// Undoes writeMerged, or returns nullopt if `merged` does not start like
+// one of its layouts. A file that does but is then malformed throws.
+// `cplusplus` is false for a .c host, as when merging. A guestExt limits the
+// search to that language; without one, a fast-layout Ruby guest ending in
+// =pod and =cut (not valid Ruby) would pass for Perl.
+std::optional<SplitMerge> splitMerged(std::string_view merged, bool cplusplus, const std::string& guestExt = "") {
+    const std::size_t npos = std::string_view::npos;
+    // Offset of the first line at or after `from` that starts with `lines`.
+    auto findLines = [&](const std::string& lines, std::size_t from) {
+        for (std::size_t pos = merged.find(lines, from); pos != npos; pos = merged.find(lines, pos + 1)) {
+            if (pos == 0 || merged[pos - 1] == '\n') return pos;
+        }
+        return npos;
+    };
+    // Only the directive writeMerged marked; the host may start with its own.
+    auto dropLineDirective = [](std::string_view& host) {
+        std::string_view first = host.substr(0, host.find('\n'));
+        if (first.size() == host.size() || first.substr(0, 9) != "#line 1 \"") return;
+        if (first.size() < directiveMarker.size() + 9 || first.substr(first.size() - directiveMarker.size()) != directiveMarker) return;
+        host.remove_prefix(first.size() + 1);
+    };
+    // The guest's region ends with the seal, if any: the marker, then only
+    // #*/ and #endif lines.
+    auto dropSeal = [&](std::string_view& guest) {
+        const std::string marker = sealMarker + "\n";
+        std::size_t seal = guest.rfind(marker);
+        while (seal != npos && seal > 0 && guest[seal - 1] != '\n') seal = guest.rfind(marker, seal - 1);
+        if (seal == npos) return;
+        for (std::size_t pos = seal + marker.size(); pos < guest.size();) {
+            std::size_t end = guest.find('\n', pos);
+            std::string_view line = guest.substr(pos, end - pos);
+            if (line != "#*/" && line != "#endif") return;
+            pos = end + 1;
         }
-        return out;
+        guest = guest.substr(0, seal);
     };
 
-    if (ext1 == ".cpp" || ext1 == ".cc" || ext1 == ".cxx" || ext1 == ".c") {
-        writeLine(escapeCpp(openFence(ext2)));
-        for (const std::string& l : content1) {
-            writeLine(escapeForPython(l));
+    if (merged.substr(0, 6) != "#if 0\n") return std::nullopt;
+    SplitMerge split;
+    const std::size_t second = 6;
+    auto wanted = [&](const char* ext) { return guestExt.empty() || guestExt == ext; };
+    for (const char* ext : {".py", ".rb", ".sh", ".pl"}) {
+        if (!wanted(ext)) continue;
+        const std::string prefix = openFence(ext) + "\n#endif\n\n";
+        if (merged.compare(second, prefix.size(), prefix) != 0) continue;
+
+        // Compat: the host runs to the first line that closes the fence;
+        // writeMerged made sure no host line does.
+        const std::size_t hostStart = second + prefix.size();
+        const std::string tail = "#if 0\n" + closeFence(ext) + "\n#endif\n\n#if 0\n";
+        std::size_t close = findLines(tail, hostStart);
+        if (close == npos || merged.size() < close + tail.size() + 7
+            || merged.substr(merged.size() - 7) != "#endif\n") {
+            throw std::runtime_error("the " + std::string(ext) + " fence is not closed the way polyglot closes it");
         }
-        writeLine(escapeCpp(closeFence(ext2)));
+        split.guestExt = ext;
+        split.host = merged.substr(hostStart, close - hostStart);
+        split.guest = merged.substr(close + tail.size(), merged.size() - 7 - close - tail.size());
+        dropLineDirective(split.host);
+        dropSeal(split.guest);
+        return split;
+    }
 
-        writeLine("#if 0");
-        for (auto& l : content2) {
-            writeLine(escapeForPython(l));
+    // Fast: the guest ends where the C preprocessor sees our #endif close
+    // the group, which must follow the script end. sealGuest balanced the
+    // guest, so that is the first #endif at depth 0. One scan finds it; it
+    // stops at the last place the script end appears, so a host that does
+    // not repeat those lines is not read.
+    for (const char* ext : {".pl", ".rb", ".sh"}) {
+        if (!wanted(ext)) continue;
+        std::string end;
+        for (const std::string& l : scriptEnd(ext)) end += l + "\n";
+        end += "#endif\n";
+        std::size_t last = npos;
+        for (std::size_t pos = findLines(end, second); pos != npos; pos = findLines(end, pos + 1)) last = pos;
+        if (last == npos) continue;
+        SkippedGroup g = scanSkippedGroup(merged.substr(second, last + end.size() - second), cplusplus);
+        if (g.strayDirective != "#endif") continue;
+        std::size_t endif = second;
+        for (std::size_t l = 1; l < g.strayLine; l++) endif = merged.find('\n', endif) + 1;
+        const std::size_t pos = endif - (end.size() - 7);
+        if (endif - second < end.size() - 7 || merged.compare(pos, end.size(), end) != 0
+            || (pos > second && merged[pos - 1] != '\n')) {
+            continue;
         }
-        writeLine("#endif");
+        split.guestExt = ext;
+        split.layout = Layout::Fast;
+        split.guest = merged.substr(second, pos - second);
+        split.host = merged.substr(pos + end.size());
+        dropLineDirective(split.host);
+        dropSeal(split.guest);
+        return split;
     }
-    else if (ext2 == ".cpp" || ext2 == ".cc" || ext2 == ".cxx" || ext2 == ".c") {
-        writeLine(escapeCpp(openFence(ext1)));
-        for (auto& l : content2) writeLine(l);
-        writeLine(escapeCpp(closeFence(ext1)));
+    return std::nullopt;
+}
 
-        writeLine("#if 0");
-        for (auto& l : content1) writeLine(l);
-        writeLine("#endif");
+// Writes a host half, undoing escapeForPython for Python guests. A host
+// that itself contained \'\'\' comes back as ''', since the escape cannot
+// tell the two apart.
+void writeHost(std::ostream& out, std::string_view host, const std::string& guestExt) {
+    if (guestExt != ".py") {
+        out.write(host.data(), host.size());
+        return;
     }
-    else {
-        throw std::runtime_error("No C/C++ file in pair");
+    const std::string_view escaped = "\\'\\'\\'";
+    std::size_t pos = 0;
+    for (std::size_t hit = host.find(escaped); hit != std::string_view::npos; hit = host.find(escaped, pos)) {
+        out.write(host.data() + pos, hit - pos);
+        out.write("'''", 3);
+        pos = hit + escaped.size();
     }
+    out.write(host.data() + pos, host.size() - pos);
+}
+
+// The merged file is written under a temporary name next to the output and
+// renamed over it only by commit(), so a failed run leaves any previous
+// output untouched. Destroying an uncommitted PendingOutput removes the
+// temporary file, and so does a SIGINT, SIGTERM or SIGHUP once main() has
+// called removeOnSignals. SIGKILL still leaves it behind.
+class PendingOutput {
+public:
+    explicit PendingOutput(const std::string& outFile) : outFile(outFile) {
+        // Renaming onto a symlink would replace the link, not its target.
+        std::error_code ec;
+        if (fs::is_symlink(outFile, ec)) {
+            fs::path target = fs::canonical(outFile, ec);
+            if (!ec) this->outFile = target.string();
+        }
+        fs::path path(this->outFile);
+        std::string name = (path.parent_path() / ("." + path.filename().string() + ".XXXXXX")).string();
+        std::lock_guard<std::mutex> lock(pendingMutex);
+#ifdef POLYGLOT_POSIX
+        int fd = mkstemp(&name[0]);
+        if (fd < 0) throw std::runtime_error("Failed to open output: " + outFile + ": " + std::strerror(errno));
+        tmpPath = name;
+        pendingPaths.insert(tmpPath);
+        // mkstemp creates the file 0600; give it the mode the output would
+        // have had.
+        struct stat st;
+        mode_t mode;
+        if (stat(this->outFile.c_str(), &st) == 0) {
+            mode = st.st_mode & 07777;
+        } else {
+            mode = 0666 & ~processUmask;
+        }
+        fchmod(fd, mode);
+        close(fd);
+#else
+        tmpPath = name.substr(0, name.size() - 6) + "tmp";
+        pendingPaths.insert(tmpPath);
+#endif
+    }
+
+    ~PendingOutput() {
+        if (committed) return;
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
+        pendingPaths.erase(tmpPath);
+    }
+
+    PendingOutput(const PendingOutput&) = delete;
+    PendingOutput& operator=(const PendingOutput&) = delete;
+
+    void write(const std::string& text) {
+        write([&](std::ostream& out) { out << text; });
+    }
+
+    void write(const std::function<void(std::ostream&)>& produce) {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) throw std::runtime_error("Failed to open output: " + tmpPath);
+        produce(out);
+        out.close();
+        if (!out) throw std::runtime_error("Failed to write output: " + tmpPath);
+    }
+
+    void commit() {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        fs::rename(tmpPath, outFile);
+        pendingPaths.erase(tmpPath);
+        committed = true;
+    }
+
+#ifdef POLYGLOT_POSIX
+    // Reading the umask means setting it for the whole process, so main()
+    // does it once before any thread starts.
+    static void readUmask() {
+        processUmask = umask(0);
+        umask(processUmask);
+    }
+
+    // Blocks the signals in every thread started after this, and leaves
+    // them to one thread that removes the pending files and then dies of
+    // the same signal. It keeps pendingMutex, so no new file appears.
+    // Signals ignored at startup, as under nohup, stay ignored.
+    static void removeOnSignals() {
+        sigset_t set;
+        sigemptyset(&set);
+        bool any = false;
+        for (int sig : {SIGINT, SIGTERM, SIGHUP}) {
+            struct sigaction old;
+            if (sigaction(sig, nullptr, &old) != 0 || old.sa_handler == SIG_IGN) continue;
+            sigaddset(&set, sig);
+            any = true;
+        }
+        if (!any) return;
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        std::thread([set] {
+            int sig = 0;
+            while (sigwait(&set, &sig) != 0) {}
+            pendingMutex.lock();
+            for (const std::string& path : pendingPaths) unlink(path.c_str());
+            signal(sig, SIG_DFL);
+            sigset_t one;
+            sigemptyset(&one);
+            sigaddset(&one, sig);
+            pthread_sigmask(SIG_UNBLOCK, &one, nullptr);
+            raise(sig);
+        }).detach();
+    }
+#endif
+
+private:
+#ifdef POLYGLOT_POSIX
+    static inline mode_t processUmask = 022;
+#endif
+    static inline std::mutex pendingMutex;
+    static inline std::set<std::string> pendingPaths;
+    std::string outFile;
+    std::string tmpPath;
+    bool committed = false;
+};
+
+struct CheckResult {
+    bool ok;
+    std::string diagnostics;
+};
+
+// Runs checkSyntax on its own thread; the number of checkers actually
+// running at once is bounded by JobServer.
+std::future<CheckResult> checkSyntaxAsync(const std::string& file, const std::string& ext,
+                                          std::optional<CheckScheduler::Ticket> queued) {
+    auto ticket = std::make_shared<std::optional<CheckScheduler::Ticket>>(std::move(queued));
+    return std::async(std::launch::async, [file, ext, ticket] {
+        std::ostringstream diag;
+        bool ok = checkSyntax(file, ext, diag, std::move(*ticket));
+        return CheckResult{ok, diag.str()};
+    });
+}
+
+// fuzz_merge.cpp includes this file for the merge engine and brings its own
+// entry point.
+#ifndef POLYGLOT_NO_MAIN
+// One output file: two sources merged in the given order.
+struct MergeJob {
+    std::string file1;
+    std::string file2;
+    std::string outFile;
+};
+
+// Checks every distinct source once, all concurrently. Meanwhile it reads
+// each source once and merges every job into its own pending output. A job's
+// output is committed only if both of its sources passed; the rest are
+// reported and discarded. Returns 0 if every job was written.
+int runMerges(const std::vector<MergeJob>& jobs, Layout layout, bool lineDirectives, bool verbose) {
+    std::vector<std::string> files;
+    for (const MergeJob& job : jobs) {
+        for (const std::string* f : {&job.file1, &job.file2}) {
+            if (std::find(files.begin(), files.end(), *f) == files.end()) files.push_back(*f);
+        }
+    }
+    // Queue every external check before starting any, so the scheduler sees
+    // the cheap ones before g++ can take the memory budget. In-process checks
+    // only queue if they fall back to the tool.
+    std::vector<std::optional<CheckScheduler::Ticket>> tickets;
+    for (const std::string& f : files) {
+        std::string ext = fs::path(f).extension().string();
+        tickets.emplace_back();
+        if (!embedsChecker(ext)) tickets.back().emplace(CheckScheduler::instance().enqueue(CheckScheduler::language(ext)));
+    }
+    std::vector<std::future<CheckResult>> checks;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        checks.push_back(checkSyntaxAsync(files[i], fs::path(files[i]).extension().string(), std::move(tickets[i])));
+    }
+
+    // Read and merge while the checks run. Errors wait until the checks have
+    // reported, as they would have come after them.
+    std::map<std::string, std::vector<std::string>> contents;
+    std::map<std::string, std::string> readErrors;
+    {
+        Stats::Phase phase("read");
+        for (const std::string& f : files) {
+            try {
+                contents[f] = readFile(f);
+                for (const std::string& l : contents[f]) phase.addBytes(l.size() + 1);
+            } catch (const std::exception& x) {
+                readErrors[f] = x.what();
+            }
+        }
+    }
+    std::vector<std::string> errors(jobs.size());
+    std::vector<std::string> merged(jobs.size());
+    {
+        Stats::Phase phase("merge");
+        for (std::size_t i = 0; i < jobs.size(); i++) {
+            const MergeJob& job = jobs[i];
+            for (const std::string* f : {&job.file1, &job.file2}) {
+                auto failed = readErrors.find(*f);
+                if (failed != readErrors.end() && errors[i].empty()) errors[i] = failed->second;
+            }
+            if (!errors[i].empty()) continue;
+            std::ostringstream out;
+            try {
+                std::string ext1 = fs::path(job.file1).extension().string();
+                std::string hostName = !lineDirectives ? "" : isCppExt(ext1) ? job.file1 : job.file2;
+                writeMerged(out, ext1, contents[job.file1], fs::path(job.file2).extension().string(),
+                            contents[job.file2], layout, hostName);
+                merged[i] = out.str();
+                phase.addBytes(merged[i].size());
+            } catch (const std::exception& x) {
+                errors[i] = x.what();
+            }
+        }
+    }
+    std::vector<std::optional<PendingOutput>> outputs(jobs.size());
+    {
+        Stats::Phase phase("write");
+        for (std::size_t i = 0; i < jobs.size(); i++) {
+            if (!errors[i].empty()) continue;
+            try {
+                outputs[i].emplace(jobs[i].outFile);
+                outputs[i]->write(merged[i]);
+                phase.addBytes(merged[i].size());
+            } catch (const std::exception& x) {
+                errors[i] = x.what();
+            }
+            merged[i].clear();
+            merged[i].shrink_to_fit();
+        }
+    }
+
+    std::map<std::string, bool> passed;
+    {
+        Stats::Phase phase("wait");
+        for (std::size_t i = 0; i < files.size(); i++) {
+            if (verbose) std::cout << "Checking syntax for " << files[i] << "... " << std::flush;
+            CheckResult res = checks[i].get();
+            passed[files[i]] = res.ok;
+            if (!res.ok) {
+                std::cerr << res.diagnostics << "\nSyntax error in " << files[i] << "\n";
+                continue;
+            }
+            if (verbose) std::cout << "OK\n";
+        }
+    }
+
+    int status = 0;
+    for (std::size_t i = 0; i < jobs.size(); i++) {
+        const MergeJob& job = jobs[i];
+        if (!passed[job.file1] || !passed[job.file2]) {
+            if (jobs.size() > 1) std::cerr << "Skipped " << job.outFile << "\n";
+            status = 1;
+            continue;
+        }
+        if (errors[i].empty()) {
+            try {
+                outputs[i]->commit();
+            } catch (const std::exception& x) {
+                errors[i] = x.what();
+            }
+        }
+        if (!errors[i].empty()) {
+            std::cerr << "Error: " << errors[i] << "\n";
+            status = 1;
+            continue;
+        }
+        if (verbose) std::cout << "Merged into " << job.outFile << "\n";
+    }
+    return status;
+}
+
+// Fan-out: the one C/C++ source paired with each of the others, written to
+// <outDir>/<guest file name><host extension>, such as core.py.cpp.
+static std::vector<MergeJob> fanOutJobs(const std::vector<std::string>& sources, const std::string& outDir) {
+    std::vector<std::string> hosts;
+    for (const std::string& s : sources) {
+        if (isCppExt(fs::path(s).extension().string())) hosts.push_back(s);
+    }
+    if (hosts.size() != 1) {
+        throw std::runtime_error("merging into a directory needs exactly one C/C++ source, got "
+                                 + std::to_string(hosts.size()));
+    }
+    std::string hostExt = fs::path(hosts[0]).extension().string();
+    std::error_code ec;
+    fs::create_directories(outDir, ec);
+    if (!fs::is_directory(outDir)) throw std::runtime_error("Failed to create output directory: " + outDir);
+
+    std::set<std::string> sourcePaths;
+    for (const std::string& s : sources) sourcePaths.insert(fs::weakly_canonical(s).string());
+    std::map<std::string, std::string> written;  // output -> guest
+    std::vector<MergeJob> jobs;
+    for (const std::string& guest : sources) {
+        if (guest == hosts[0]) continue;
+        std::string out = (fs::path(outDir) / (fs::path(guest).filename().string() + hostExt)).string();
+        std::string key = fs::weakly_canonical(out).string();
+        if (sourcePaths.count(key)) throw std::runtime_error("output " + out + " for " + guest + " would overwrite a source");
+        auto [it, fresh] = written.emplace(key, guest);
+        if (!fresh) throw std::runtime_error(it->second + " and " + guest + " would both be written to " + out);
+        jobs.push_back({hosts[0], guest, out});
+    }
+    return jobs;
+}
+
+// Where a guest is extracted to when no path is given: next to hostOut,
+// named after it with the guest's extension. A fan-out output such as
+// a.py.cpp already names its guest, which comes back as a.py.
+static std::string guestPathFor(const std::string& hostOut, const std::string& guestExt) {
+    fs::path path(hostOut);
+    fs::path stem = path.stem();
+    if (stem.extension().string() == guestExt) return (path.parent_path() / stem).string();
+    return (path.parent_path() / (stem.string() + guestExt)).string();
+}
+
+// Splits one merged file into hostOut and guestOut, committing both only
+// when both are written. An empty guestOut comes from guestPathFor.
+// Returns false if `merged` is no polyglot merge at all.
+static bool extractOne(const std::string& merged, const std::string& hostOut, std::string guestOut,
+                       std::uint64_t& bytes) {
+    MappedFile file(merged);
+    const bool cplusplus = fs::path(merged).extension().string() != ".c";
+    const std::string wanted = fs::path(guestOut).extension().string();
+    std::optional<SplitMerge> split;
+    try {
+        split = splitMerged(file.view(), cplusplus, wanted);
+        if (!split && !wanted.empty()) {
+            if ((split = splitMerged(file.view(), cplusplus))) {
+                throw std::runtime_error("holds a " + split->guestExt + " guest, not " + wanted);
+            }
+        }
+    } catch (const std::exception& x) {
+        throw std::runtime_error(merged + ": " + x.what());
+    }
+    if (!split) return false;
+    if (guestOut.empty()) guestOut = guestPathFor(hostOut, split->guestExt);
+    PendingOutput host(hostOut);
+    PendingOutput guest(guestOut);
+    host.write([&](std::ostream& out) { writeHost(out, split->host, split->guestExt); });
+    guest.write([&](std::ostream& out) { out.write(split->guest.data(), split->guest.size()); });
+    host.commit();
+    guest.commit();
+    bytes += file.view().size();
+    return true;
+}
+
+// --extract: one merged file, or every C/C++ file directly in a directory.
+// Directories are split in parallel, a JobServer token per file, and
+// files that are no merges are skipped.
+static int runExtract(const std::string& from, const std::string& to, const std::string& guestOut, bool verbose) {
+    Stats::Phase phase("extract");
+    std::uint64_t bytes = 0;
+    if (!fs::is_directory(from)) {
+        try {
+            if (!extractOne(from, to, guestOut, bytes)) {
+                std::cerr << "Error: " << from << " is not a polyglot merge\n";
+                return 1;
+            }
+        } catch (const std::exception& x) {
+            std::cerr << "Error: " << x.what() << "\n";
+            return 1;
+        }
+        phase.addBytes(bytes);
+        if (verbose) std::cout << "Extracted " << from << "\n";
+        return 0;
+    }
+
+    std::error_code ec;
+    fs::create_directories(to, ec);
+    if (!fs::is_directory(to)) {
+        std::cerr << "Error: Failed to create output directory: " << to << "\n";
+        return 1;
+    }
+    if (fs::equivalent(from, to, ec)) {
+        std::cerr << "Error: extracting " << from << " into itself would overwrite the merged files\n";
+        return 1;
+    }
+    std::vector<std::string> files;
+    for (const fs::directory_entry& entry : fs::directory_iterator(from, ec)) {
+        if (entry.is_regular_file() && isCppExt(entry.path().extension().string())) files.push_back(entry.path().string());
+    }
+    std::sort(files.begin(), files.end());
+
+    // Guests are named by guestPathFor, so files that share a stem once a
+    // guest extension is dropped from it (a.c, a.cpp and a.py.cpp) collide
+    // if their guests share a language. Only those are split ahead to find
+    // out.
+    std::map<std::string, std::vector<std::string>> byStem;
+    for (const std::string& f : files) {
+        fs::path stem = fs::path(f).stem();
+        if (!openFence(stem.extension().string()).empty()) stem = stem.stem();
+        byStem[stem.string()].push_back(f);
+    }
+    std::map<std::string, std::string> written;  // guest output -> merged file
+    for (const auto& [stem, group] : byStem) {
+        if (group.size() < 2) continue;
+        for (const std::string& f : group) {
+            std::optional<SplitMerge> split;
+            try {
+                MappedFile file(f);
+                split = splitMerged(file.view(), fs::path(f).extension().string() != ".c");
+            } catch (const std::exception&) {
+                continue;  // reported when it is extracted
+            }
+            if (!split) continue;
+            std::string out = guestPathFor((fs::path(to) / fs::path(f).filename()).string(), split->guestExt);
+            auto [it, fresh] = written.emplace(out, f);
+            if (!fresh) {
+                std::cerr << "Error: " << it->second << " and " << f << " would both write their guest to " << out << "\n";
+                return 1;
+            }
+        }
+    }
+
+    std::vector<std::string> messages(files.size());
+    std::vector<char> failed(files.size());
+    std::vector<std::uint64_t> sizes(files.size());
+    std::atomic<std::size_t> next{0};
+    auto work = [&] {
+        for (std::size_t i; (i = next++) < files.size();) {
+            auto token = JobServer::instance().acquire();
+            std::string hostOut = (fs::path(to) / fs::path(files[i]).filename()).string();
+            try {
+                if (extractOne(files[i], hostOut, "", sizes[i])) messages[i] = "Extracted " + files[i];
+                else messages[i] = "Skipped " + files[i] + ": not a polyglot merge";
+            } catch (const std::exception& x) {
+                messages[i] = "Error: " + std::string(x.what());
+                failed[i] = true;
+            }
+        }
+    };
+    unsigned threads = static_cast<unsigned>(std::min<std::size_t>(files.size(), std::max(1u, std::thread::hardware_concurrency())));
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++) workers.emplace_back(work);
+    work();
+    for (std::thread& t : workers) t.join();
+
+    int status = 0;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        phase.addBytes(sizes[i]);
+        if (failed[i]) {
+            std::cerr << messages[i] << "\n";
+            status = 1;
+        } else if (verbose) {
+            std::cout << messages[i] << "\n";
+        }
+    }
+    return status;
 }
 
 int main(int argc, char* argv[]) {
+#ifdef POLYGLOT_POSIX
+    PendingOutput::readUmask();
+    PendingOutput::removeOnSignals();
+#endif
+    // Before any file is opened, so that jobserver descriptors make closed
+    // cannot be confused with ours.
+    JobServer::instance();
     std::vector<std::string> args(argv, argv + argc);
     if (argc < 5) {
         std::cerr << usageStr;
         return 1;
     }
     bool verbose = false;
-    std::string file1, file2, outFile;
+    Layout layout = Layout::Compat;
+    bool lineDirectives = false;
+    std::string extractFrom;
+    std::vector<std::string> sources;
+    std::string outFile;
     for (int i = 1; i < argc; i++) {
         if (args[i] == "-o") {
             if (i + 1 >= argc) {
@@ -206,44 +2317,122 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             outFile = args[++i];
-        } else if (file1.empty()) {
-            file1 = args[i];
-        } else if (file2.empty()) {
-            file2 = args[i];
         } else if (args[i] == "-v" || args[i] == "--verbose") {
             verbose = true;
+        } else if (args[i] == "--stats") {
+            Stats::instance().enabled = true;
+        } else if (args[i] == "--extract") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --extract requires an argument\n";
+                return 1;
+            }
+            extractFrom = args[++i];
+        } else if (args[i] == "--line-directives") {
+            lineDirectives = true;
+        } else if (args[i] == "--layout") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --layout requires an argument\n";
+                return 1;
+            }
+            std::string value = args[++i];
+            if (value == "compat") layout = Layout::Compat;
+            else if (value == "fast") layout = Layout::Fast;
+            else {
+                std::cerr << "Error: unknown layout: " << value << " (expected compat or fast)\n";
+                return 1;
+            }
+        } else if (args[i] == "--mem-budget") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --mem-budget requires an argument\n";
+                return 1;
+            }
+            std::string value = args[++i];
+            char* end = nullptr;
+            unsigned long long mb = std::strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end || mb == 0) {
+                std::cerr << "Error: invalid memory budget: " << value << "\n";
+                return 1;
+            }
+            CheckScheduler::instance().setBudget(mb);
+        } else if (args[i] == "--limit") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --limit requires an argument\n";
+                return 1;
+            }
+            // lang=jobs[:MB]
+            std::string value = args[++i];
+            std::size_t eq = value.find('=');
+            std::string lang = value.substr(0, eq);
+            std::string jobsStr = eq == std::string::npos ? "" : value.substr(eq + 1);
+            std::string memStr;
+            std::size_t colon = jobsStr.find(':');
+            if (colon != std::string::npos) {
+                memStr = jobsStr.substr(colon + 1);
+                jobsStr.erase(colon);
+            }
+            char* jobsEnd = nullptr;
+            char* memEnd = nullptr;
+            unsigned long jobs = std::strtoul(jobsStr.c_str(), &jobsEnd, 10);
+            unsigned long long mem = std::strtoull(memStr.c_str(), &memEnd, 10);
+            if (!CheckScheduler::instance().knows(lang) || jobsStr.empty() || *jobsEnd
+                || (colon != std::string::npos && (memStr.empty() || *memEnd))) {
+                std::cerr << "Error: invalid limit: " << value << " (expected cpp|py|rb|sh|pl=<jobs>[:<MB>])\n";
+                return 1;
+            }
+            CheckScheduler::instance().setLimit(lang, static_cast<unsigned>(jobs),
+                                                colon == std::string::npos ? std::nullopt : std::optional<std::uint64_t>(mem));
+        } else if (args[i] == "-j" || args[i] == "--jobs" || args[i].rfind("-j", 0) == 0) {
+            std::string value = args[i].size() > 2 && args[i] != "--jobs" ? args[i].substr(2) : "";
+            if (value.empty()) {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: -j requires an argument\n";
+                    return 1;
+                }
+                value = args[++i];
+            }
+            int jobs = std::atoi(value.c_str());
+            if (jobs < 1) {
+                std::cerr << "Error: invalid job count: " << value << "\n";
+                return 1;
+            }
+            JobServer::instance().setLocalLimit(static_cast<unsigned>(jobs));
         } else {
-            std::cerr << "Error: unexpected argument: " << args[i] << "\n";
-            return 1;
+            sources.push_back(args[i]);
         }
     }
 
-    if (file1.empty() || file2.empty() || outFile.empty()) {
+    if (!extractFrom.empty() ? sources.size() > 1 || outFile.empty() : sources.size() < 2 || outFile.empty()) {
         std::cerr << usageStr;
         return 1;
     }
 
-    std::string ext1 = fs::path(file1).extension().string();
-    std::string ext2 = fs::path(file2).extension().string();
+    // Reports on every way out of main().
+    struct StatsReport {
+        ~StatsReport() {
+            if (Stats::instance().enabled) Stats::instance().report(std::cerr);
+        }
+    } statsReport;
 
-    if (verbose) std::cout << "Checking syntax for " << file1 << "... ";
-    if (!checkSyntax(file1, ext1)) {
-        std::cerr << "\nSyntax error in " << file1 << "\n";
-        return 1;
-    }
-    if (verbose) std::cout << "OK\n";
+    if (!extractFrom.empty()) return runExtract(extractFrom, outFile, sources.empty() ? "" : sources[0], verbose);
 
-    if (verbose) std::cout << "Checking syntax for " << file2 << "... ";
-    if (!checkSyntax(file2, ext2)) {
-        std::cerr << "\nSyntax error in " << file2 << "\n";
+    std::vector<MergeJob> jobs;
+    bool toDir = outFile.back() == '/' || fs::is_directory(outFile);
+#ifdef _WIN32
+    toDir = toDir || outFile.back() == '\\';
+#endif
+    if (sources.size() == 2 && !toDir) {
+        jobs.push_back({sources[0], sources[1], outFile});
+    } else if (!toDir) {
+        std::cerr << "Error: -o must name a directory when merging more than two sources\n";
         return 1;
+    } else {
+        try {
+            jobs = fanOutJobs(sources, outFile);
+        } catch (const std::exception& x) {
+            std::cerr << "Error: " << x.what() << "\n";
+            return 1;
+        }
     }
-    if (verbose) std::cout << "OK\n";
-
-    auto content1 = readFile(file1);
-    auto content2 = readFile(file2);
-
-    writeMerged(outFile, ext1, content1, ext2, content2);
-    if (verbose) std::cout << "Merged into " << outFile << "\n";
-    return 0;
+    return runMerges(jobs, layout, lineDirectives, verbose);
 }
+#endif // POLYGLOT_NO_MAIN
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import os
 import sys
 import subprocess
 from pathlib import Path
@@ -7,6 +8,11 @@ import argparse
 import shlex
 
 def run_cmd(cmd):
+    # Counted by the benchmark in test_runner (see --bench).
+    spawn_log = os.environ.get("POLYGLOT_SPAWN_LOG")
+    if spawn_log:
+        with open(spawn_log, 'a') as f:
+            f.write(cmd + '\n')
     try:
         result = subprocess.run(cmd, shell=True, capture_output=True, text=True)
         return result.stdout
@@ -59,6 +65,370 @@ def check_syntax(file_path, ext) -> bool:
         print(f"Unsupported file extension: {ext}")
         return False
 
+CPP_EXTS = ['.cpp', '.cc', '.cxx', '.c']
+
+# Marks the lines seal_guest appends (sealMarker in main.cpp).
+SEAL_MARKER = "#polyglot: seal"
+
+class MergeError(Exception):
+    pass
+
+def split_lines(text):
+    # Same as std::getline in main.cpp: only '\n' ends a line and '\r' is kept.
+    lines = text.split('\n')
+    if lines[-1] == '':
+        lines.pop()
+    return lines
+
+def read_lines(path):
+    with open(path, 'r', encoding='utf-8', errors='surrogateescape', newline='') as f:
+        return split_lines(f.read())
+
+# The guest's fences (see openFence in main.cpp).
+def open_fence(ext):
+    if ext == '.py': return "r'''"
+    if ext == '.rb': return "=begin"
+    if ext == '.sh': return ": <<'POLYGLOT_EOF'"
+    if ext == '.pl': return "=pod"
+    return ""
+
+def close_fence(ext):
+    if ext == '.py': return "'''"
+    if ext == '.rb': return "=end"
+    if ext == '.sh': return "POLYGLOT_EOF"
+    if ext == ".pl": return "=cut"
+    return ""
+
+def check_host_line(guest_ext, line, line_no):
+    close = close_fence(guest_ext)
+    if guest_ext in ('.rb', '.pl'):
+        ends = line.startswith(close)
+    else:
+        ends = guest_ext == '.sh' and line == close
+    if ends:
+        raise MergeError(f"line {line_no} of the C/C++ source would end the {guest_ext} fence ({close})")
+
+BLANKS = ' \t\f\v'
+
+def is_ident_char(c):
+    return ('a' <= c <= 'z') or ('A' <= c <= 'Z') or ('0' <= c <= '9') or c in '_$' or ord(c) >= 0x80
+
+def escape_for_python(lines, cplusplus):
+    # Port of escapeForPython in main.cpp: escapes each ''' that would end
+    # the r''' fence, or rejects the line.
+    text = ''.join(line + '\n' for line in lines)
+    src, at = [], []
+    i = 0
+    while i < len(text):
+        c = text[i]
+        if c == '\\':
+            j = i + 1
+            while j < len(text) and text[j] in BLANKS:
+                j += 1
+            if j < len(text) and text[j] in '\r\n':
+                if text[j] == '\r' and j + 1 < len(text) and text[j + 1] == '\n':
+                    j += 1
+                i = j + 1
+                continue
+        if c == '\r' and i + 1 < len(text) and text[i + 1] == '\n':
+            i += 1
+            continue
+        src.append('\n' if c == '\r' else c)
+        at.append(i)
+        i += 1
+    src = ''.join(src)
+
+    where = ['code'] * len(text)
+    n = len(src)
+    def mark(start, end, what):
+        for k in range(start, n if end < 0 else min(end, n)):
+            where[at[k]] = what
+    i = 0
+    while i < n:
+        c = src[i]
+        nxt = src[i + 1] if i + 1 < n else ''
+        if c == '/' and nxt == '/':
+            end = src.find('\n', i + 2)
+            mark(i + 2, end, 'text')
+            i = n if end < 0 else end
+        elif c == '/' and nxt == '*':
+            end = src.find('*/', i + 2)
+            mark(i + 2, end, 'text')
+            i = n if end < 0 else end + 2
+        elif c in '"\'':
+            j = i + 1
+            while j < n and src[j] != '\n' and src[j] != c:
+                j += 2 if src[j] == '\\' and j + 1 < n and src[j + 1] != '\n' else 1
+            mark(i + 1, j, 'text')
+            i = j + 1 if j < n and src[j] == c else j
+        elif '0' <= c <= '9' or (c == '.' and '0' <= nxt <= '9'):
+            i += 1
+            while i < n:
+                d = src[i]
+                if (d in '+-' and src[i - 1] in 'eEpP') or d == '.' or is_ident_char(d):
+                    i += 1
+                elif cplusplus and d == "'" and i + 1 < n and is_ident_char(src[i + 1]):
+                    i += 2
+                else:
+                    break
+        elif is_ident_char(c):
+            start = i
+            while i < n and is_ident_char(src[i]):
+                i += 1
+            if src[start:i] not in ('R', 'u8R', 'uR', 'UR', 'LR') or i >= n or src[i] != '"':
+                continue
+            op = i + 1
+            while (op < n and op - (i + 1) < 16 and src[op] not in '()\\\n'
+                   and src[op] not in BLANKS and ord(src[op]) < 0x80):
+                op += 1
+            if op >= n or src[op] != '(':
+                continue
+            close = ')' + src[i + 1:op] + '"'
+            end = src.find(close, op + 1)
+            mark(op + 1, end, 'raw')
+            i = n if end < 0 else end + len(close)
+        else:
+            i += 1
+
+    out = []
+    base = 0
+    for line_no, line in enumerate(lines, 1):
+        escaped = []
+        py_escape = False
+        i = 0
+        while i < len(line):
+            if py_escape:
+                py_escape = False
+            elif line[i] == '\\':
+                py_escape = True
+            elif line.startswith("'''", i):
+                part = where[base + i:base + i + 3]
+                if part != ['text'] * 3:
+                    place = 'in a raw string' if 'raw' in part else 'outside a string or comment'
+                    raise MergeError(f"line {line_no} of the C/C++ source has ''' {place}, which would end the .py fence")
+                escaped.append("\\'\\'\\'")
+                i += 3
+                continue
+            escaped.append(line[i])
+            i += 1
+        base += len(line) + 1
+        out.append(''.join(escaped))
+    return out
+
+
+class SkippedGroup:
+    def __init__(self):
+        self.depth = 0
+        self.in_comment = False
+        self.in_raw_string = False
+        self.spliced = False
+        self.stray_line = 0
+        self.stray_directive = ""
+
+def scan_skipped_group(lines, cplusplus):
+    # Port of scanSkippedGroup in main.cpp: what the C preprocessor makes of
+    # lines inside a skipped `#if 0` group.
+    g = SkippedGroup()
+    text = ''.join(line + '\n' for line in lines)
+
+    # Phases 1-2: line splices and '\r' line breaks.
+    src = []
+    line_of = []
+    line_no = 1
+    i = 0
+    size = len(text)
+    while i < size:
+        c = text[i]
+        if c == '\\':
+            j = i + 1
+            while j < size and text[j] in BLANKS:
+                j += 1
+            if j < size and text[j] in '\r\n':
+                if text[j] == '\r' and j + 1 < size and text[j + 1] == '\n':
+                    j += 1
+                if text[j] == '\n':
+                    line_no += 1
+                i = j + 1
+                g.spliced = i == size
+                continue
+        if c == '\r' and i + 1 < size and text[i + 1] == '\n':
+            i += 1
+            continue
+        src.append('\n' if c == '\r' else c)
+        line_of.append(line_no)
+        if c == '\n':
+            line_no += 1
+        i += 1
+    src = ''.join(src)
+
+    # Phases 3-4, reduced to what can open or close a conditional.
+    n = len(src)
+    bol = True
+    i = 0
+    while i < n:
+        c = src[i]
+        nxt = src[i + 1] if i + 1 < n else ''
+        if c == '\n':
+            bol = True
+            i += 1
+        elif c in BLANKS:
+            i += 1
+        elif c == '/' and nxt == '*':
+            end = src.find('*/', i + 2)
+            if end < 0:
+                g.in_comment = True
+                return g
+            i = end + 2
+        elif c == '/' and nxt == '/':
+            i = src.find('\n', i)
+            if i < 0:
+                i = n
+        elif bol and (c == '#' or (c == '%' and nxt == ':')):
+            hash_at = i
+            i += 1 if c == '#' else 2
+            while True:
+                while i < n and src[i] in BLANKS:
+                    i += 1
+                if not src.startswith('/*', i):
+                    break
+                end = src.find('*/', i + 2)
+                if end < 0:
+                    g.in_comment = True
+                    return g
+                i = end + 2
+            start = i
+            while i < n and is_ident_char(src[i]):
+                i += 1
+            name = src[start:i]
+            if name in ('if', 'ifdef', 'ifndef'):
+                g.depth += 1
+            elif name in ('else', 'elif', 'elifdef', 'elifndef', 'endif'):
+                if g.depth == 0:
+                    g.stray_line = line_of[hash_at]
+                    g.stray_directive = '#' + name
+                    return g
+                if name == 'endif':
+                    g.depth -= 1
+            # Lex the name again as a token: `#R"x(` opens a raw string.
+            i = start
+            bol = False
+        elif c in '"\'':
+            bol = False
+            i += 1
+            # An unterminated literal stops at the end of the line, even
+            # right after a backslash.
+            while i < n and src[i] != '\n':
+                if src[i] == '\\' and src[i + 1:i + 2] != '\n':
+                    i += 1
+                elif src[i] == c:
+                    i += 1
+                    break
+                i += 1
+        elif '0' <= c <= '9' or (c == '.' and '0' <= nxt <= '9'):
+            bol = False
+            i += 1
+            while i < n:
+                d = src[i]
+                sign = d in '+-' and src[i - 1] in 'eEpP'
+                if sign or d == '.' or is_ident_char(d):
+                    i += 1
+                    continue
+                if cplusplus and d == "'" and i + 1 < n and is_ident_char(src[i + 1]):
+                    i += 2
+                    continue
+                break
+        elif is_ident_char(c):
+            bol = False
+            start = i
+            while i < n and is_ident_char(src[i]):
+                i += 1
+            if src[start:i] not in ('R', 'u8R', 'uR', 'UR', 'LR') or i >= n or src[i] != '"':
+                continue
+            opening = i + 1
+            while (opening < n and opening - (i + 1) < 16 and src[opening] not in '()\\\n'
+                   and src[opening] not in BLANKS and ord(src[opening]) < 0x80):
+                opening += 1
+            if opening >= n or src[opening] != '(':
+                continue
+            close = ')' + src[i + 1:opening] + '"'
+            end = src.find(close, opening + 1)
+            if end < 0:
+                g.in_raw_string = True
+                return g
+            i = end + len(close)
+        else:
+            bol = False
+            i += 1
+    return g
+
+def seal_guest(guest, cplusplus):
+    # Lines appended after the guest so the C preprocessor's view of the
+    # skipped group ends where ours does (see sealGuest in main.cpp).
+    for i, line in enumerate(guest):
+        if line == SEAL_MARKER:
+            raise MergeError(f"line {i + 1} of the guest source is reserved: {SEAL_MARKER}")
+    g = scan_skipped_group(guest, cplusplus)
+    if g.stray_directive:
+        raise MergeError(f"line {g.stray_line} of the guest source reads as {g.stray_directive} to the C preprocessor")
+    if g.spliced:
+        raise MergeError("the guest source ends with a backslash; the C preprocessor would join it with the closing #endif")
+    if g.in_raw_string:
+        raise MergeError("the guest source opens a C++ raw string literal that never closes")
+    if not g.in_comment and g.depth == 0:
+        return []
+    seal = [SEAL_MARKER]
+    if g.in_comment:
+        seal.append("#*/")
+    return seal + ["#endif"] * g.depth
+
+def script_end(ext):
+    # Lines that stop the guest interpreter in the fast layout (see
+    # scriptEnd in main.cpp).
+    if ext == '.rb': return ["__END__"]
+    if ext == '.pl': return ["=pod", "=cut", "__END__"]
+    if ext == '.sh': return ["exit"]
+    return []
+
+# Marks the #line directive merge_lines adds (directiveMarker in main.cpp).
+DIRECTIVE_MARKER = " /* polyglot */"
+
+def line_directive(n, file):
+    name = file.replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+    return f'#line {n} "{name}"'
+
+def merge_lines(ext1, content1, ext2, content2, layout='compat', host_name=None):
+    if ext1 not in CPP_EXTS and ext2 not in CPP_EXTS:
+        raise MergeError("No C/C++ file in pair")
+    if ext1 in CPP_EXTS:
+        host_ext, host, guest_ext, guest = ext1, content1, ext2, content2
+    else:
+        host_ext, host, guest_ext, guest = ext2, content2, ext1, content1
+    if not open_fence(guest_ext):
+        raise MergeError(f"Unsupported guest language: {guest_ext}")
+
+    end = script_end(guest_ext)
+    if layout == 'fast' and end:
+        seal = seal_guest(guest, host_ext != '.c')
+        directive = [line_directive(1, host_name) + DIRECTIVE_MARKER] if host_name else []
+        return ["#if 0"] + guest + seal + end + ["#endif"] + directive + host
+
+    for i, line in enumerate(host):
+        check_host_line(guest_ext, line, i + 1)
+    seal = seal_guest(guest, host_ext != '.c')
+
+    out = ["#if 0", open_fence(guest_ext), "#endif", ""]
+    directive = [line_directive(1, host_name) + DIRECTIVE_MARKER] if host_name else []
+    if guest_ext == '.py':
+        directive = escape_for_python(directive, host_ext != '.c')
+        host = escape_for_python(host, host_ext != '.c')
+    out += directive + host
+    out += ["#if 0", close_fence(guest_ext), "#endif", ""]
+    out.append("#if 0")
+    out += guest
+    out += seal
+    out.append("#endif")
+    return out
+
 verbose = None
 
 def main():
@@ -77,6 +447,10 @@ Supported extensions:
     parser.add_argument('source2', help='Second source file')
     parser.add_argument('-o', '--output', required=True, help='Output file')
     parser.add_argument('-v', '--verbose', help='verbose mode')
+    parser.add_argument('--layout', choices=['compat', 'fast'], default='compat',
+                        help='fast puts the guest first and stops its interpreter before the C/C++ code')
+    parser.add_argument('--line-directives', action='store_true',
+                        help="emit #line so the compiler sees the C/C++ source's own name and line numbers")
     args = parser.parse_args()
 
     file1 = Path(args.source1)
@@ -101,58 +475,20 @@ Supported extensions:
         return 1
     if verbose: print("OK")
 
-    # Read files
-    with open(file1, 'r') as f:
-        content1 = f.read().splitlines()
-    with open(file2, 'r') as f:
-        content2 = f.read().splitlines()
-
-    # Determine fence tokens
-    def open_fence(ext):
-        if ext == '.py': return "r'''"
-        if ext == '.rb': return "=begin"
-        if ext == '.sh': return ": '"
-        if ext == '.pl': return "=pod"
-        return ""
-
-    def close_fence(ext):
-        if ext == '.py': return "'''"
-        if ext == '.rb': return "=end"
-        if ext == '.sh': return "'"
-        if ext == ".pl": return "=cut"
-        return ""
-
-    # Write merged file
-    with open(out_file, 'w', newline='\n') as f:
-        if ext1 in ['.cpp', '.cc', '.cxx', '.c']:
-            # Write C++ content with fence tokens for the other language
-            f.write(f"#if 0\n{open_fence(ext2)}\n#endif\n")
-            for line in content1:
-                f.write(line + '\n')
-            f.write(f"#if 0\n{close_fence(ext2)}\n#endif\n")
-            
-            # Write non-C++ content within #if 0 block
-            f.write("#if 0\n")
-            for line in content2:
-                f.write(line + '\n')
-            f.write("#endif\n")
-            
-        elif ext2 in ['.cpp', '.cc', '.cxx', '.c']:
-            # Write C++ content with fence tokens for the other language
-            f.write(f"#if 0\n{open_fence(ext1)}\n#endif\n")
-            for line in content2:
-                f.write(line + '\n')
-            f.write(f"#if 0\n{close_fence(ext1)}\n#endif\n")
-            
-            # Write non-C++ content within #if 0 block
-            f.write("#if 0\n")
-            for line in content1:
-                f.write(line + '\n')
-            f.write("#endif\n")
-            
-        else:
-            print("Error: No C/C++ file in pair")
-            return 1
+    host_name = None
+    if args.line_directives:
+        host_name = args.source1 if ext1 in CPP_EXTS else args.source2
+
+    # Read and merge
+    try:
+        merged = merge_lines(ext1, read_lines(file1), ext2, read_lines(file2), args.layout, host_name)
+    except (MergeError, OSError) as e:
+        print(f"Error: {e}")
+        return 1
+
+    with open(out_file, 'w', encoding='utf-8', errors='surrogateescape', newline='') as f:
+        for line in merged:
+            f.write(line + '\n')
 
     if verbose: print(f"Merged into {out_file}")
     return 0
@@ -5,8 +5,17 @@
 #include <utility>
 #include <cstdio>
 #include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <filesystem>
+#include <regex>
+#include <iomanip>
+#include <functional>
 #if defined(__APPLE__) || defined(__linux__)
 #include <sys/wait.h> // for WIFEXITED, WEXITSTATUS
+#include <sys/resource.h> // for wait4 rusage
 #endif
 #include <unistd.h>
 
@@ -15,6 +24,9 @@ using namespace std;
 struct CommandResult {
     int exitCode;
     string output;
+    double wallMs = 0;
+    double cpuMs = 0;     // user + system time of the command and its children
+    long maxRssKb = 0;    // largest resident set among them
 };
 
 static string esc_reset = "\033[0m";
@@ -31,7 +43,53 @@ CommandResult runCommand(const std::string& cmd) {
 
     std::array<char, 256> buffer;
     std::string result;
+    auto start = chrono::steady_clock::now();
+    auto elapsedMs = [&start] {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
 
+#if defined(__APPLE__) || defined(__linux__)
+    // fork/exec instead of popen so wait4 can report the command's CPU time
+    // and peak RSS (both include the children it waited for).
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return { -1, "pipe() failed for: " + cmd };
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return { -1, "fork() failed for: " + cmd };
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    close(fds[1]);
+    ssize_t n;
+    while ((n = read(fds[0], buffer.data(), buffer.size())) > 0) {
+        result.append(buffer.data(), n);
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage ru {};
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR) {}
+    CommandResult res{ WIFEXITED(status) ? WEXITSTATUS(status) : -1, result };
+    res.wallMs = elapsedMs();
+    res.cpuMs = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0
+              + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+#if defined(__APPLE__)
+    res.maxRssKb = ru.ru_maxrss / 1024; // bytes on macOS
+#else
+    res.maxRssKb = ru.ru_maxrss;
+#endif
+    return res;
+#else
     std::string shellCmd = cmd + " 2>&1";
     FILE* pipe = popen(shellCmd.c_str(), "r");
     if (!pipe) {
@@ -43,10 +101,10 @@ CommandResult runCommand(const std::string& cmd) {
     }
 
     int rc = pclose(pipe);
-#if defined(__unix__) || defined(__APPLE__)
-    if (WIFEXITED(rc)) rc = WEXITSTATUS(rc);
+    CommandResult res{ rc, result };
+    res.wallMs = elapsedMs();
+    return res;
 #endif
-    return { rc, result };
 }
 
 struct TestCase {
@@ -56,6 +114,10 @@ struct TestCase {
     string compileCmd;
     string compiledExe;
     vector<pair<string,string>> runSteps;
+    // Run in-process, so they need no shell: setup before the generator,
+    // and checks after the run steps, each returning what went wrong or "".
+    function<void()> setup;
+    vector<pair<string, function<string()>>> checks;
 };
 
 struct TestResult {
@@ -84,21 +146,487 @@ static string normalizePath(string p) {
     return p;
 }
 
-int main() {
-    string testDir = normalizePath("./test");
-
-    printHeader("--- Polyglot test runner ---");
-    cout << "Test directory: " << testDir << "\n\n";
-
-    // Build polyglot
-    cout << esc_blue << "Step: build polyglot from main.cpp (g++ main.cpp -o polyglot)" << esc_reset << "\n";
-    auto buildPoly = runCommand("g++ main.cpp -std=c++17 -o polyglot");
+// POLYGLOT_BUILD_FLAGS is appended to the compile, e.g. to test a build
+// with embedded interpreters.
+static void buildPolyglot(const string &flags = "") {
+    const char* extra = getenv("POLYGLOT_BUILD_FLAGS");
+    string cmd = "g++ main.cpp -std=c++17 -o polyglot";
+    if (extra && *extra) cmd += string(" ") + extra;
+    if (!flags.empty()) cmd += " " + flags;
+    cout << esc_blue << "Step: build polyglot from main.cpp (" << cmd << ")" << esc_reset << "\n";
+    auto buildPoly = runCommand(cmd);
     if (buildPoly.exitCode == 0) {
         cout << esc_green << "Built polyglot OK\n" << esc_reset;
     } else {
         cout << esc_yellow << "Warning: build returned " << buildPoly.exitCode << "\n"
              << buildPoly.output << esc_reset << "\n";
     }
+}
+
+// Generators: compiled binary and python
+static vector<pair<string,string>> generatorList() {
+    return {
+        {exePrefix + "polyglot" + exeSuffix, "C++ binary"},
+        {"python main.py", "Python script"}
+    };
+}
+
+// ---- Synthetic corpus for --bench ----
+// Each generator repeats a realistic block `units` times, so file sizes
+// scale linearly with --scale.
+
+static string genCpp(int units) {
+    ostringstream o;
+    o << "// Generated by test_runner --gen-corpus\n"
+      << "#include <cstdio>\n#include <cstring>\n\n";
+    for (int i = 0; i < units; ++i) {
+        o << "// classify_" << i << ": weighs quotes; python docstrings look like '''this'''\n"
+          << "static int classify_" << i << "(const char* s) {\n"
+          << "    int score = " << i % 7 << ";\n"
+          << "    for (const char* p = s; *p; ++p) {\n"
+          << "        switch (*p) {\n"
+          << "        case '\\'': score += 3; break;\n"
+          << "        case '\"': score += 2; break;\n"
+          << "        case '\\\\': score -= 1; break;\n"
+          << "        case '{': case '}': score += 4; break;\n"
+          << "        default: score += (*p == ' ') ? 0 : 1;\n"
+          << "        }\n"
+          << "    }\n"
+          << "    /* a block comment with 'single' and \"double\" quotes */\n"
+          << "    if (std::strstr(s, \"'''\") != nullptr) score *= 2;\n"
+          << "    return score;\n"
+          << "}\n\n";
+    }
+    o << "int main() {\n    long total = 0;\n";
+    for (int i = 0; i < units; ++i) {
+        o << "    total += classify_" << i << "(\"it's '''quoted''' #" << i << "\");\n";
+    }
+    o << "    std::printf(\"%ld\\n\", total);\n    return 0;\n}\n";
+    return o.str();
+}
+
+static string genPython(int units) {
+    ostringstream o;
+    o << "# Generated by test_runner --gen-corpus\n\n";
+    for (int i = 0; i < units; ++i) {
+        o << "def step_" << i << "(values):\n"
+          << "    \"\"\"Fold values for stage " << i << "; keeps 'quotes' intact.\"\"\"\n"
+          << "    total = 0\n"
+          << "    for index, value in enumerate(values):\n"
+          << "        if value % 3 == " << i % 3 << ":\n"
+          << "            total += index * value\n"
+          << "        elif value < 0:\n"
+          << "            total -= value\n"
+          << "        else:\n"
+          << "            total += len(str(value))\n"
+          << "    return total\n\n\n";
+    }
+    o << "if __name__ == \"__main__\":\n    data = list(range(-5, 50))\n    result = 0\n";
+    for (int i = 0; i < units; ++i) {
+        o << "    result += step_" << i << "(data)\n";
+    }
+    o << "    print(result)\n";
+    return o.str();
+}
+
+static string genBash(int units) {
+    ostringstream o;
+    o << "#!/usr/bin/env bash\n# Generated by test_runner --gen-corpus\n\n";
+    for (int i = 0; i < units; ++i) {
+        o << "section_" << i << "() {\n"
+          << "    cat <<EOF\n"
+          << "Section " << i << " for ${USER:-nobody}\n"
+          << "  it's at /var/lib/app/" << i << "\n"
+          << "  count: $((" << i << " * 2))\n"
+          << "EOF\n"
+          << "    cat <<'RAW'\n"
+          << "literal $HOME and `ticks` stay as-is in section " << i << "\n"
+          << "RAW\n"
+          << "}\n\n";
+    }
+    o << "for i in $(seq 0 " << units - 1 << "); do\n    \"section_$i\"\ndone > /dev/null\n"
+      << "echo \"Hello from Bash!\"\n";
+    return o.str();
+}
+
+static string genPerl(int units) {
+    ostringstream o;
+    o << "# Generated by test_runner --gen-corpus\nuse strict;\nuse warnings;\n\n";
+    for (int i = 0; i < units; ++i) {
+        o << "=head1 section_" << i << "\n\n"
+          << "Scales its argument. Accepts C<$x> and returns I<$x * " << i << ">.\n\n"
+          << "=head2 Notes\n\n"
+          << "Quotes such as ''' and \"\" are plain text here.\n\n"
+          << "=cut\n\n"
+          << "sub section_" << i << " {\n"
+          << "    my ($x) = @_;\n"
+          << "    return $x * " << i << " + length(\"'''\");\n"
+          << "}\n\n";
+    }
+    o << "my $total = 0;\n";
+    for (int i = 0; i < units; ++i) {
+        o << "$total += section_" << i << "(1);\n";
+    }
+    o << "print \"$total\\n\";\n";
+    return o.str();
+}
+
+struct CorpusPair {
+    string name, host, guest, output;
+};
+
+static vector<CorpusPair> writeCorpus(const string &dir, int units) {
+    filesystem::create_directories(dir);
+    vector<pair<string, string>> files = {
+        {"big.cpp", genCpp(units)},
+        {"long.py", genPython(units)},
+        {"heredoc.sh", genBash(units)},
+        {"pod.pl", genPerl(units)},
+    };
+    for (auto &f : files) {
+        ofstream(dir + "/" + f.first, ios::binary) << f.second;
+    }
+    return {
+        {"cpp+py", dir + "/big.cpp", dir + "/long.py", dir + "/out_py.cpp"},
+        {"cpp+sh", dir + "/big.cpp", dir + "/heredoc.sh", dir + "/out_sh.cpp"},
+        {"cpp+pl", dir + "/big.cpp", dir + "/pod.pl", dir + "/out_pl.cpp"},
+    };
+}
+
+// ---- --bench: time each generator over the corpus against a baseline ----
+
+struct BenchOptions {
+    string corpusDir = "bench_corpus";
+    string baselineFile = "bench_baseline.tsv";
+    int scale = 2000;
+    int reps = 3;
+    double threshold = 1.25;
+    bool updateBaseline = false;
+    bool countsOnly = false;
+    bool alloc = false;
+};
+
+// The alloc fields stay 0 unless --alloc measured them. maxRssKb is the
+// binary's own peak from --stats; main.py has no such report and gets 0.
+// In a baseline, 0 means not recorded and is not compared.
+struct BenchSample {
+    double wallMs = 0;
+    double cpuMs = 0;
+    long maxRssKb = 0;
+    long spawns = 0;
+    long long allocs = 0;
+    long long allocBytes = 0;
+    long long peakLive = 0;
+};
+
+// Reads the "allocations:" line of a --stats report from a build with
+// POLYGLOT_ALLOC_STATS.
+static bool parseAllocLine(const string &output, BenchSample &s) {
+    size_t at = output.find("allocations: ");
+    if (at == string::npos) return false;
+    return sscanf(output.c_str() + at, "allocations: %lld allocs, %lld bytes, peak live %lld bytes",
+                  &s.allocs, &s.allocBytes, &s.peakLive) == 3;
+}
+
+// The "process:" line of a --stats report: polyglot's peak RSS without the
+// checkers it spawned. Not printed on Windows.
+static long parseSelfRss(const string &output) {
+    size_t at = output.find("process: max RSS ");
+    long kb = 0;
+    if (at != string::npos) sscanf(output.c_str() + at, "process: max RSS %ld KB", &kb);
+    return kb;
+}
+
+static void setEnv(const string &name, const string &value) {
+#ifdef _WIN32
+    _putenv_s(name.c_str(), value.c_str());
+#else
+    setenv(name.c_str(), value.c_str(), 1);
+#endif
+}
+
+static map<string, BenchSample> readBaseline(const string &path) {
+    map<string, BenchSample> out;
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string gen, pairName;
+        BenchSample s;
+        if (getline(fields, gen, '\t') && getline(fields, pairName, '\t')
+            && fields >> s.wallMs >> s.cpuMs >> s.maxRssKb >> s.spawns) {
+            // Baselines written before --alloc existed end here.
+            fields >> s.allocs >> s.allocBytes >> s.peakLive;
+            out[gen + "\t" + pairName] = s;
+        }
+    }
+    return out;
+}
+
+static void writeBaseline(const string &path, const map<string, BenchSample> &samples) {
+    ofstream out(path);
+    out << "# generator\tpair\twall_ms\tcpu_ms\tmax_rss_kb\tspawns\tallocs\talloc_bytes\tpeak_live\n";
+    for (auto &kv : samples) {
+        out << kv.first << "\t" << kv.second.wallMs << "\t" << kv.second.cpuMs << "\t"
+            << kv.second.maxRssKb << "\t" << kv.second.spawns << "\t" << kv.second.allocs << "\t"
+            << kv.second.allocBytes << "\t" << kv.second.peakLive << "\n";
+    }
+}
+
+static int runBench(const BenchOptions &opt) {
+    printHeader("--- Polyglot benchmark ---");
+    buildPolyglot(opt.alloc ? "-DPOLYGLOT_ALLOC_STATS" : "");
+
+    auto pairs = writeCorpus(opt.corpusDir, opt.scale);
+    string spawnLog = opt.corpusDir + "/spawns.log";
+    setEnv("POLYGLOT_SPAWN_LOG", spawnLog);
+
+    map<string, BenchSample> results;
+    auto generators = generatorList();
+    for (auto &g : generators) {
+        // Only the C++ binary reports its own memory and allocations.
+        const bool binary = g.first == generators.front().first;
+        const bool countAllocs = opt.alloc && binary;
+        for (auto &p : pairs) {
+            BenchSample best;
+            for (int r = 0; r < opt.reps; ++r) {
+                filesystem::remove(spawnLog);
+                auto res = runCommand(g.first + " " + p.host + " " + p.guest + " -o " + p.output
+                                      + (binary ? " --stats" : ""));
+                if (res.exitCode != 0) {
+                    cout << esc_red << g.second << " failed on " << p.name << "\n" << res.output << esc_reset << "\n";
+                    return 2;
+                }
+                ifstream log(spawnLog);
+                long spawns = 0;
+                for (string l; getline(log, l);) ++spawns;
+                // Keep the fastest run; memory and spawn counts should not vary.
+                if (r == 0 || res.wallMs < best.wallMs) {
+                    best.wallMs = res.wallMs;
+                    best.cpuMs = res.cpuMs;
+                }
+                // wait4's peak would be the largest checker's, usually g++.
+                if (binary) best.maxRssKb = max(best.maxRssKb, parseSelfRss(res.output));
+                best.spawns = max(best.spawns, spawns);
+                if (countAllocs && !parseAllocLine(res.output, best)) {
+                    cout << esc_red << g.second << " printed no allocation counts on " << p.name
+                         << esc_reset << "\n";
+                    return 2;
+                }
+            }
+            results[g.second + "\t" + p.name] = best;
+        }
+    }
+
+    auto baseline = readBaseline(opt.baselineFile);
+    int regressions = 0;
+    int unmeasured = 0;
+    cout << esc_bold << "\n=== BENCHMARK (scale " << opt.scale << ", best of " << opt.reps << ") ===" << esc_reset << "\n";
+    for (auto &kv : results) {
+        const BenchSample &s = kv.second;
+        string label = kv.first;
+        label[label.find('\t')] = ' ';
+        cout << label << ": wall " << s.wallMs << " ms, cpu " << s.cpuMs << " ms, rss ";
+        if (s.maxRssKb) cout << s.maxRssKb << " KB";
+        else cout << "-";
+        cout << ", spawns " << s.spawns;
+        if (s.allocs) cout << ", allocs " << s.allocs << " (" << s.allocBytes << " B, peak " << s.peakLive << " B)";
+        auto it = baseline.find(kv.first);
+        if (opt.updateBaseline) {
+            cout << "\n";
+            continue;
+        }
+        if (it == baseline.end()) {
+            ++unmeasured;
+            cout << esc_red << "  NO BASELINE" << esc_reset << "\n";
+            continue;
+        }
+        const BenchSample &b = it->second;
+        // The absolute slack keeps timer and page-size noise from failing
+        // small measurements.
+        vector<string> over;
+        if (b.wallMs && s.wallMs > b.wallMs * opt.threshold && s.wallMs - b.wallMs > 25) over.push_back("wall");
+        if (b.maxRssKb && s.maxRssKb > b.maxRssKb * opt.threshold && s.maxRssKb - b.maxRssKb > 1024) {
+            over.push_back("rss");
+        }
+        if (s.spawns > b.spawns) over.push_back("spawns");
+        if (s.allocs && b.allocs && s.allocs > b.allocs * opt.threshold) over.push_back("allocs");
+        if (over.empty()) {
+            cout << esc_green << "  OK" << esc_reset;
+            if (b.wallMs) cout << " (baseline wall " << b.wallMs << " ms)";
+            else cout << " (baseline has counts only)";
+            cout << "\n";
+            continue;
+        }
+        ++regressions;
+        cout << esc_red << "  REGRESSION:";
+        for (auto &o : over) cout << " " << o;
+        cout << " (baseline wall " << b.wallMs << " ms, rss " << b.maxRssKb << " KB, spawns "
+             << b.spawns << ")" << esc_reset << "\n";
+    }
+
+    if (opt.updateBaseline) {
+        // Times and RSS depend on the machine; counts do not, so a
+        // --counts-only baseline can be committed and gate any runner.
+        if (opt.countsOnly) {
+            for (auto &kv : results) kv.second.wallMs = kv.second.cpuMs = kv.second.maxRssKb = 0;
+        }
+        writeBaseline(opt.baselineFile, results);
+        cout << "Baseline written to " << opt.baselineFile << "\n";
+        return 0;
+    }
+    // A gate with nothing to compare against must not pass.
+    if (unmeasured) {
+        cout << esc_red << unmeasured << " result(s) have no entry in " << opt.baselineFile
+             << "; record one on this machine with --update-baseline" << esc_reset << "\n";
+        return 2;
+    }
+    if (regressions) {
+        cout << esc_red << regressions << " result(s) exceed the baseline by more than "
+             << (opt.threshold - 1) * 100 << "%" << esc_reset << "\n";
+        return 2;
+    }
+    return 0;
+}
+
+// ---- Per-step timing and the --json results file ----
+
+// Wall and CPU time of every step, then the totals per kind of step
+// (generator, compile, run-compiled, run-interpreter).
+static void printTimings(const vector<TestResult> &results) {
+    cout << esc_bold << "\n=== TIMING (wall / cpu ms) ===" << esc_reset << "\n";
+    map<string, pair<double, double>> totals;
+    vector<string> order;
+    cout << fixed << setprecision(1);
+    for (auto &r : results) {
+        cout << (r.passed ? esc_green : esc_red) << r.name << esc_reset << "\n";
+        for (auto &step : r.stepResults) {
+            cout << "  " << left << setw(16) << step.first << right << setw(10) << step.second.wallMs
+                 << setw(10) << step.second.cpuMs << "\n";
+            if (!totals.count(step.first)) order.push_back(step.first);
+            totals[step.first].first += step.second.wallMs;
+            totals[step.first].second += step.second.cpuMs;
+        }
+    }
+    cout << esc_bold << "Total per step:" << esc_reset << "\n";
+    for (auto &name : order) {
+        cout << "  " << left << setw(16) << name << right << setw(10) << totals[name].first
+             << setw(10) << totals[name].second << "\n";
+    }
+    cout << defaultfloat << setprecision(6);
+}
+
+static string jsonString(const string &s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof buf, "\\u%04x", c);
+                out += buf;
+            } else {
+                out += char(c);
+            }
+        }
+    }
+    return out + "\"";
+}
+
+// One object per test with its steps, in run order. Output is kept only
+// for failed steps.
+static bool writeJson(const string &path, const vector<TestResult> &results, int shardIndex, int shardCount,
+                      const string &filter) {
+    ofstream out(path);
+    out << "{\n  \"shard\": \"" << shardIndex << "/" << shardCount << "\",\n"
+        << "  \"filter\": " << jsonString(filter) << ",\n  \"tests\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &r = results[i];
+        out << (i ? "," : "") << "\n    {\"name\": " << jsonString(r.name) << ", \"passed\": "
+            << (r.passed ? "true" : "false") << ", \"steps\": [";
+        for (size_t j = 0; j < r.stepResults.size(); ++j) {
+            auto &step = r.stepResults[j];
+            auto &res = step.second;
+            out << (j ? "," : "") << "\n      {\"step\": " << jsonString(step.first) << ", \"exitCode\": "
+                << res.exitCode << ", \"wallMs\": " << res.wallMs << ", \"cpuMs\": " << res.cpuMs
+                << ", \"maxRssKb\": " << res.maxRssKb;
+            if (res.exitCode != 0) out << ", \"output\": " << jsonString(res.output);
+            out << "}";
+        }
+        out << (r.stepResults.empty() ? "]}" : "\n    ]}");
+    }
+    out << (results.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    return bool(out);
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions bench;
+    bool benchMode = false;
+    string corpusOnly;
+    string filter;
+    string jsonFile;
+    int shardIndex = 1, shardCount = 1;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        auto next = [&]() -> string {
+            if (i + 1 >= argc) {
+                cerr << a << " requires an argument\n";
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (a == "--bench") benchMode = true;
+        else if (a == "--gen-corpus") corpusOnly = next();
+        else if (a == "--scale") bench.scale = max(1, atoi(next().c_str()));
+        else if (a == "--reps") bench.reps = max(1, atoi(next().c_str()));
+        else if (a == "--baseline") bench.baselineFile = next();
+        else if (a == "--threshold") bench.threshold = atof(next().c_str());
+        else if (a == "--update-baseline") bench.updateBaseline = true;
+        else if (a == "--counts-only") bench.countsOnly = true;
+        else if (a == "--alloc") bench.alloc = true;
+        else if (a == "--filter") filter = next();
+        else if (a == "--json") jsonFile = next();
+        else if (a == "--shard") {
+            string spec = next();
+            char slash = 0;
+            istringstream in(spec);
+            if (!(in >> shardIndex >> slash >> shardCount) || slash != '/' || !in.eof()
+                || shardCount < 1 || shardIndex < 1 || shardIndex > shardCount) {
+                cerr << "--shard expects i/n with 1 <= i <= n, got " << spec << "\n";
+                return 1;
+            }
+        }
+        else {
+            cerr << "Usage: " << argv[0] << " [--filter REGEX] [--shard I/N] [--json FILE]\n"
+                 << "       " << argv[0] << " --bench [--scale N] [--reps N] [--baseline FILE]"
+                 << " [--threshold X] [--update-baseline [--counts-only]] [--alloc]\n"
+                 << "       " << argv[0] << " --gen-corpus DIR\n";
+            return 1;
+        }
+    }
+    regex filterRe;
+    try {
+        filterRe = regex(filter);
+    } catch (const regex_error &e) {
+        cerr << "--filter: invalid regex " << filter << ": " << e.what() << "\n";
+        return 1;
+    }
+    if (!corpusOnly.empty()) {
+        for (auto &p : writeCorpus(corpusOnly, bench.scale)) cout << p.host << " + " << p.guest << "\n";
+        return 0;
+    }
+    if (benchMode) return runBench(bench);
+
+    string testDir = normalizePath("./test");
+
+    printHeader("--- Polyglot test runner ---");
+    cout << "Test directory: " << testDir << "\n\n";
 
     auto mkCompile = [](const string &compiler, const string &input, const string &outputExe) {
         return compiler + " " + input + " -o " + outputExe + exeSuffix;
@@ -106,11 +634,7 @@ int main() {
 
     vector<TestCase> tests;
 
-    // Generators: compiled binary and python
-    vector<pair<string,string>> generators = {
-        {exePrefix + "polyglot" + exeSuffix, "C++ binary"},
-        {"python main.py", "Python script"}
-    };
+    auto generators = generatorList();
 
     struct PairDef {
         string a,b,genFile,compiler,exePath,runCompiledCmd,runScriptCmd;
@@ -166,6 +690,135 @@ int main() {
         }
     }
 
+    // --layout fast: the guest comes first and ends the script before the
+    // C++ code. Python has no such layout.
+    for (auto &g : generators) {
+        for (auto &p : combos_cpp_style) {
+            if (p.a.find("/test.py") != string::npos || p.b.find("/test.py") != string::npos) continue;
+            TestCase t;
+            t.name = g.second + " : " + (p.a.substr(p.a.find_last_of('/')+1)) + " + " + (p.b.substr(p.b.find_last_of('/')+1)) + " (fast)";
+            t.generatorCmd = g.first + " " + normalizePath(p.a) + " " + normalizePath(p.b) + " -o " + normalizePath(p.genFile) + " --layout fast";
+            t.generatedFile = normalizePath(p.genFile);
+            t.compileCmd = mkCompile(p.compiler, normalizePath(p.genFile), normalizePath(p.exePath));
+            t.compiledExe = normalizePath(p.exePath) + exeSuffix;
+            t.runSteps.push_back({"run-compiled", p.runCompiledCmd});
+            t.runSteps.push_back({"run-interpreter", p.runScriptCmd});
+            tests.push_back(std::move(t));
+        }
+    }
+
+    // --extract round trips: merge, split the result again, and compare
+    // both halves with the sources. Only the C++ binary extracts. The
+    // fixtures lack a final newline, which extract adds back.
+    auto sameText = [](const string &source, const string &extracted) {
+        return [=]() -> string {
+            ifstream a(source, ios::binary), b(extracted, ios::binary);
+            if (!b) return "cannot read " + extracted;
+            string want((istreambuf_iterator<char>(a)), istreambuf_iterator<char>());
+            string got((istreambuf_iterator<char>(b)), istreambuf_iterator<char>());
+            while (!want.empty() && want.back() == '\n') want.pop_back();
+            return got == want + "\n" ? "" : extracted + " differs from " + source;
+        };
+    };
+    const string extractDir = testDir + "/extract";
+    auto freshDir = [extractDir] {
+        filesystem::remove_all(extractDir);
+        filesystem::create_directories(extractDir);
+    };
+    const string &binary = generators.front().first;
+    for (string guest : {"test.py", "test.rb", "test.sh", "test.pl"}) {
+        for (string layout : {"compat", "fast"}) {
+            if (layout == "fast" && guest == "test.py") continue;
+            string ext = guest.substr(guest.find('.'));
+            TestCase t;
+            t.name = generators.front().second + " : extract test.cpp + " + guest + " (" + layout + ")";
+            t.generatorCmd = binary + " " + testDir + "/test.cpp " + testDir + "/" + guest + " -o " + testDir
+                + "/out.cpp --line-directives --layout " + layout;
+            t.generatedFile = testDir + "/out.cpp";
+            t.setup = freshDir;
+            t.runSteps.push_back({"extract", binary + " --extract " + testDir + "/out.cpp -o " + extractDir + "/host.cpp"});
+            t.checks.push_back({"diff-host", sameText(testDir + "/test.cpp", extractDir + "/host.cpp")});
+            t.checks.push_back({"diff-guest", sameText(testDir + "/" + guest, extractDir + "/host" + ext)});
+            tests.push_back(std::move(t));
+        }
+    }
+    // Fan-out: one host into every guest at once. The guests share the stem
+    // "test", so each output has to carry its guest's language.
+    const string fanOut = binary + " " + testDir + "/test.cpp " + testDir + "/test.py "
+        + testDir + "/test.rb " + testDir + "/test.sh " + testDir + "/test.pl -o " + extractDir + "/merged/";
+    const map<string, string> interpreters = {{"py", "python"}, {"rb", "ruby"}, {"sh", "bash"}, {"pl", "perl"}};
+    {
+        TestCase t;
+        t.name = generators.front().second + " : fan-out test.cpp + test.py test.rb test.sh test.pl";
+        t.setup = freshDir;
+        t.generatorCmd = fanOut;
+        t.generatedFile = extractDir + "/merged/test.py.cpp";
+        t.compileCmd = mkCompile("g++", t.generatedFile, extractDir + "/out");
+        t.compiledExe = extractDir + "/out" + exeSuffix;
+        t.runSteps.push_back({"run-compiled", ""});
+        for (const auto &[lang, interpreter] : interpreters) {
+            t.runSteps.push_back({"run-interpreter", interpreter + " " + extractDir + "/merged/test." + lang + ".cpp"});
+        }
+        tests.push_back(std::move(t));
+    }
+    {
+        // Split the fan-out directory back: test.py.cpp gives test.py.
+        TestCase t;
+        t.name = generators.front().second + " : extract directory";
+        t.setup = freshDir;
+        t.generatorCmd = fanOut;
+        t.generatedFile = extractDir + "/merged";
+        t.runSteps.push_back({"extract", binary + " --extract " + extractDir + "/merged/ -o " + extractDir + "/split/"});
+        for (const auto &[lang, interpreter] : interpreters) {
+            string merged = extractDir + "/split/test." + lang + ".cpp";
+            t.checks.push_back({"diff-host", sameText(testDir + "/test.cpp", merged)});
+            t.checks.push_back({"diff-guest", sameText(testDir + "/test." + lang, extractDir + "/split/test." + lang)});
+        }
+        tests.push_back(std::move(t));
+    }
+
+#if !defined(_WIN32)
+    // Checker limits hold across processes: three merges run at once with a
+    // fake g++ that notes when another copy of it is already running.
+    for (string limit : {"--limit cpp=1", "--mem-budget 1024"}) {
+        const string dir = testDir + "/limits";
+        TestCase t;
+        t.name = generators.front().second + " : three processes, " + limit;
+        t.generatorCmd = "rm -rf " + dir + " && mkdir -p " + dir + "/bin && printf '%s\\n' '#!/bin/sh' 'mkdir "
+            + dir + "/busy 2>/dev/null || echo overlap >> " + dir + "/overlap' 'sleep 0.3' 'rmdir " + dir
+            + "/busy' > " + dir + "/bin/g++ && chmod +x " + dir + "/bin/g++ && for k in 1 2 3; do PATH=" + dir
+            + "/bin:$PATH " + binary + " " + testDir + "/test.cpp " + testDir + "/test.sh -o " + dir + "/out$k.cpp "
+            + limit + " & done; wait";
+        t.generatedFile = dir + "/out1.cpp";
+        t.runSteps.push_back({"outputs", "test -s " + dir + "/out1.cpp && test -s " + dir + "/out2.cpp && test -s " + dir
+            + "/out3.cpp"});
+        t.runSteps.push_back({"one-at-a-time", "test ! -e " + dir + "/overlap"});
+        tests.push_back(std::move(t));
+    }
+#endif
+
+    // --filter picks tests by name, then --shard deals the rest out round
+    // robin, so every shard gets a similar mix of generators and languages.
+    vector<TestCase> selected;
+    size_t matched = 0;
+    for (auto &t : tests) {
+        if (!filter.empty() && !regex_search(t.name, filterRe)) continue;
+        if (matched++ % shardCount == size_t(shardIndex - 1)) selected.push_back(std::move(t));
+    }
+    tests = std::move(selected);
+    cout << "Selected " << tests.size() << " of " << matched << " matching test(s)";
+    if (shardCount > 1) cout << ", shard " << shardIndex << "/" << shardCount;
+    cout << "\n\n";
+
+    // Only build the binary when a selected test runs it.
+    const string binaryGen = generators.front().first;
+    for (auto &t : tests) {
+        if (t.generatorCmd.find(binaryGen + " ") != string::npos) {
+            buildPolyglot();
+            break;
+        }
+    }
+
     // Run tests
     vector<TestResult> results;
     for (size_t i = 0; i < tests.size(); ++i) {
@@ -174,6 +827,7 @@ int main() {
 
         TestResult tr{tc.name, true, {}};
 
+        if (tc.setup) tc.setup();
         cout << "-> generator: " << tc.generatorCmd << "\n";
         auto genRes = runCommand(tc.generatorCmd);
         tr.stepResults.push_back({"generator", genRes});
@@ -186,32 +840,35 @@ int main() {
 
         cout << esc_green << "generator OK\n" << esc_reset;
 
-        cout << "-> compile: " << tc.compileCmd << "\n";
-        auto compRes = runCommand(tc.compileCmd);
-        tr.stepResults.push_back({"compile", compRes});
-        if (compRes.exitCode != 0) {
-            cout << esc_red << "compile FAILED\n" << compRes.output << esc_reset << "\n";
-            tr.passed = false;
-            results.push_back(tr);
-            continue;
-        }
-        cout << esc_green << "compile OK\n" << esc_reset;
-
-        // On Unix-like systems, ensure the compiled executable is executable
-#if !defined(_WIN32)
-        {
-            string chmodCmd = "chmod +x " + tc.compiledExe;
-            auto chmodRes = runCommand(chmodCmd);
-            if (chmodRes.exitCode != 0) {
-                cout << esc_yellow << "chmod warning: " << chmodRes.output << esc_reset << "\n";
+        // Round-trip tests have nothing to compile.
+        if (!tc.compileCmd.empty()) {
+            cout << "-> compile: " << tc.compileCmd << "\n";
+            auto compRes = runCommand(tc.compileCmd);
+            tr.stepResults.push_back({"compile", compRes});
+            if (compRes.exitCode != 0) {
+                cout << esc_red << "compile FAILED\n" << compRes.output << esc_reset << "\n";
+                tr.passed = false;
+                results.push_back(tr);
+                continue;
             }
+            cout << esc_green << "compile OK\n" << esc_reset;
+
+            // On Unix-like systems, ensure the compiled executable is executable
+    #if !defined(_WIN32)
+            {
+                string chmodCmd = "chmod +x " + tc.compiledExe;
+                auto chmodRes = runCommand(chmodCmd);
+                if (chmodRes.exitCode != 0) {
+                    cout << esc_yellow << "chmod warning: " << chmodRes.output << esc_reset << "\n";
+                }
 
-            // Check file exists and show details (helpful for debugging "not found")
-            string checkFileCmd = "ls -la " + tc.compiledExe + " 2>/dev/null || echo \"File not found\"";
-            auto checkRes = runCommand(checkFileCmd);
-            cout << "File check: " << checkRes.output << "\n";
+                // Check file exists and show details (helpful for debugging "not found")
+                string checkFileCmd = "ls -la " + tc.compiledExe + " 2>/dev/null || echo \"File not found\"";
+                auto checkRes = runCommand(checkFileCmd);
+                cout << "File check: " << checkRes.output << "\n";
+            }
+    #endif
         }
-#endif
 
         for (auto &rs : tc.runSteps) {
             // Resolve the run command. For the compiled step, use the actual compiled executable
@@ -245,6 +902,21 @@ int main() {
             cout << esc_green << rs.first << " OK\n" << esc_reset;
         }
 
+        for (auto &check : tc.checks) {
+            if (!tr.passed) break;
+            auto start = chrono::steady_clock::now();
+            string problem = check.second();
+            CommandResult cr{problem.empty() ? 0 : 1, problem};
+            cr.wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            tr.stepResults.push_back({check.first, cr});
+            if (!problem.empty()) {
+                cout << esc_red << check.first << " FAILED\n" << problem << esc_reset << "\n";
+                tr.passed = false;
+                break;
+            }
+            cout << esc_green << check.first << " OK\n" << esc_reset;
+        }
+
         results.push_back(tr);
     }
 
@@ -252,6 +924,12 @@ int main() {
     int passed = 0, failed = 0;
     for (auto &r : results) (r.passed ? ++passed : ++failed);
 
+    printTimings(results);
+    if (!jsonFile.empty()) {
+        if (writeJson(jsonFile, results, shardIndex, shardCount, filter)) cout << "Results written to " << jsonFile << "\n";
+        else cout << esc_red << "Failed to write " << jsonFile << esc_reset << "\n";
+    }
+
     cout << esc_bold << "\n=== SUMMARY ===" << esc_reset << "\n";
     cout << "Total tests: " << results.size() << ", " << esc_green << "PASSED: " << passed
          << esc_reset << ", " << (failed ? esc_red : esc_green) << "FAILED: " << failed << esc_reset << "\n";